@@ -6,6 +6,7 @@
 #include <SDConfigFile.h>
 #include <Ethernet.h>
 #include <EventManager.h>
+#define _TASK_PRIORITY   // layered schedulers, see setup.ino
 #include <TaskScheduler.h> 
 #include <Bounce2.h>
 #include <SimpleList.h>
@@ -13,12 +14,19 @@
 #include <WebServer.h>
 
 #define DEBUG_RULES
+#define COALESCE_OUTPUT_EVENTS  // merge output commands piling up between relayLoop() runs
+//#define BENCHMARK_RULES       // time rule dispatch at boot, see ml2bench.ino
 
 #include "ml2enums.h"
 #include "ml2classes.h"
 
 OutputList outputList;
 InputList inputList;
+InputCapture inputCapture;
+PortScanner portScanner;
+GroupList groupList;
+SceneList sceneList;
+RuleTable ruleTable;
 
 byte mac[] = { 0x34, 0xAD, 0xBE, 0x43, 0xFE, 0x68 };
 byte ip[] = { 0, 0, 0, 0 };
@@ -39,34 +39,37 @@ void Bounce::interval(uint16_t interval_millis)
 }
 
 bool Bounce::update()
+{
+    // Read the state of the switch in a temporary variable.
+    return update(digitalRead(pin), millis());
+}
+
+bool Bounce::update(bool currentState, unsigned long now)
 {
 #ifdef BOUNCE_LOCK_OUT
     state &= ~_BV(STATE_CHANGED);
     // Ignore everything if we are locked out
-    if (millis() - previous_millis >= interval_millis) {
-        bool currentState = digitalRead(pin);
+    if (now - previous_millis >= interval_millis) {
         if ((bool)(state & _BV(DEBOUNCED_STATE)) != currentState) {
-            previous_millis = millis();
+            previous_millis = now;
             state ^= _BV(DEBOUNCED_STATE);
             state |= _BV(STATE_CHANGED);
         }
     }
     return state & _BV(STATE_CHANGED);
 #else
-    // Read the state of the switch in a temporary variable.
-    bool currentState = digitalRead(pin);
     state &= ~_BV(STATE_CHANGED);
 
     // If the reading is different from last reading, reset the debounce counter
     if ( currentState != (bool)(state & _BV(UNSTABLE_STATE)) ) {
-        previous_millis = millis();
+        previous_millis = now;
         state ^= _BV(UNSTABLE_STATE);
     } else
-        if ( millis() - previous_millis >= interval_millis ) {
+        if ( now - previous_millis >= interval_millis ) {
             // We have passed the threshold time, so the input is now stable
             // If it is different from last state, set the STATE_CHANGED flag
             if ((bool)(state & _BV(DEBOUNCED_STATE)) != currentState) {
-                previous_millis = millis();
+                previous_millis = now;
                 state ^= _BV(DEBOUNCED_STATE);
                 state |= _BV(STATE_CHANGED);
             }
@@ -76,6 +79,14 @@ bool Bounce::update()
 #endif
 }
 
+bool Bounce::set(bool debouncedState)
+{
+    uint8_t bits = debouncedState ? _BV(DEBOUNCED_STATE) | _BV(UNSTABLE_STATE) : 0;
+    bool changed = (state & _BV(DEBOUNCED_STATE)) != (bits & _BV(DEBOUNCED_STATE));
+    state = changed ? bits | _BV(STATE_CHANGED) : bits;
+    return changed;
+}
+
 bool Bounce::read()
 {
     return state & _BV(DEBOUNCED_STATE);
@@ -90,3 +101,79 @@ bool Bounce::fell()
 {
     return !( state & _BV(DEBOUNCED_STATE) ) && ( state & _BV(STATE_CHANGED));
 }
+
+
+PortScanner::PortScanner()
+    : numPorts(0)
+{}
+
+int8_t PortScanner::attach(volatile uint8_t *reg)
+{
+    for (uint8_t i = 0; i < numPorts; i++) {
+        if (ports[i].reg == reg)
+            return i;
+    }
+
+    if (numPorts == PORTSCANNER_MAX_PORTS)
+        return -1;
+
+    Port &port = ports[numPorts];
+    port.reg = reg;
+    port.bits = *reg;
+    port.changed = 0;
+    memset(port.count, 0, sizeof(port.count));
+    memset(port.reload, 0, sizeof(port.reload));
+    return numPorts++;
+}
+
+int8_t PortScanner::attach(int pin)
+{
+    uint8_t port = digitalPinToPort(pin);
+    if (port == NOT_A_PIN)
+        return -1;
+
+    return attach(portInputRegister(port));
+}
+
+void PortScanner::setDepth(int8_t port, uint8_t mask, uint8_t depth)
+{
+    if (depth < 1)
+        depth = 1;
+    if (depth > PORTSCANNER_MAX_DEPTH)
+        depth = PORTSCANNER_MAX_DEPTH;
+
+    Port &p = ports[port];
+    for (uint8_t b = 0; b < PORTSCANNER_COUNTER_BITS; b++) {
+        if ((depth - 1) & (1 << b))
+            p.reload[b] |= mask;
+        else
+            p.reload[b] &= ~mask;
+        p.count[b] = (p.count[b] & ~mask) | (p.reload[b] & mask);
+    }
+}
+
+void PortScanner::scan()
+{
+    Port *port = ports;
+    for (uint8_t i = 0; i < numPorts; i++, port++) {
+        // Pins that differ from their debounced level
+        uint8_t delta = *port->reg ^ port->bits;
+
+        // Those whose counter ran down take the new level, the others count down
+        uint8_t expired = delta;
+        for (uint8_t b = 0; b < PORTSCANNER_COUNTER_BITS; b++)
+            expired &= ~port->count[b];
+        uint8_t counting = delta & ~expired;
+
+        // Subtract one from the counting pins, every other pin starts over
+        uint8_t borrow = counting;
+        for (uint8_t b = 0; b < PORTSCANNER_COUNTER_BITS; b++) {
+            uint8_t count = port->count[b];
+            port->count[b] = ((count ^ borrow) & counting) | (port->reload[b] & ~counting);
+            borrow &= ~count;
+        }
+
+        port->bits ^= expired;
+        port->changed = expired;
+    }
+}
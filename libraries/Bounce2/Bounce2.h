@@ -56,6 +56,14 @@ class Bounce
     // Returns 0 if the state did not change
     bool update();
 
+    // Updates from a pin level sampled elsewhere, e.g. by an interrupt,
+    // at time now in milliseconds
+    bool update(bool currentState, unsigned long now);
+
+    // Takes a level that was already debounced elsewhere, e.g. by a PortScanner
+    // Returns 1 if the state changed
+    bool set(bool debouncedState);
+
     // Returns the updated pin state
     bool read();
 
@@ -72,4 +80,77 @@ class Bounce
     uint8_t pin;
 };
 
+// Maximum number of ports a PortScanner reads, ports A to L of the ATmega2560
+#ifndef PORTSCANNER_MAX_PORTS
+#define PORTSCANNER_MAX_PORTS 12
+#endif
+
+// Bits of the debounce counters, a change has to be seen in up to
+// 2^PORTSCANNER_COUNTER_BITS scans in a row
+#ifndef PORTSCANNER_COUNTER_BITS
+#define PORTSCANNER_COUNTER_BITS 6
+#endif
+#define PORTSCANNER_MAX_DEPTH (1 << PORTSCANNER_COUNTER_BITS)
+
+// Samples many pins at once by reading the input register of each port
+// they are on once per scan, instead of a digitalRead() per pin.
+//
+// The samples are debounced a whole port at a time by vertical counters:
+// bit n of counter plane b holds bit b of pin n's counter, so counting
+// down all pins of a port takes a few bitwise operations per plane however
+// many pins are wired. A pin takes a new level once it has been seen in
+// depth scans in a row. Feed the levels to Bounce::set().
+class PortScanner
+{
+ public:
+    PortScanner();
+
+    // Attaches the input register of a port, which is read as a whole
+    // Returns the port number to pass to read(), or -1 if all ports are taken
+    int8_t attach(volatile uint8_t *reg);
+
+    // Attaches an Arduino pin
+    // Returns the port number to pass to read(), or -1 if the pin is on no port
+    int8_t attach(int pin);
+
+    // Sets the number of scans in a row, 1 to PORTSCANNER_MAX_DEPTH, a new
+    // level of the pins in mask has to be seen in.  The default is 1.
+    void setDepth(int8_t port, uint8_t mask, uint8_t depth);
+
+    // Reads and debounces all attached ports
+    void scan();
+
+    // Returns the number of attached ports
+    inline uint8_t size() {
+        return numPorts;
+    }
+
+    // Returns the debounced level of a pin
+    inline bool read(int8_t port, uint8_t mask) {
+        return ports[port].bits & mask;
+    }
+
+    // Returns the debounced levels of all pins of a port
+    inline uint8_t bits(int8_t port) {
+        return ports[port].bits;
+    }
+
+    // Returns the pins of a port whose debounced level changed in the last scan
+    inline uint8_t changed(int8_t port) {
+        return ports[port].changed;
+    }
+
+ protected:
+    struct Port {
+        volatile uint8_t *reg;
+        uint8_t bits;
+        uint8_t changed;
+        uint8_t count[PORTSCANNER_COUNTER_BITS];    // counter planes, counting down
+        uint8_t reload[PORTSCANNER_COUNTER_BITS];   // depth - 1 of each pin
+    };
+
+    Port ports[PORTSCANNER_MAX_PORTS];
+    uint8_t numPorts;
+};
+
 #endif
@@ -0,0 +1,100 @@
+/*
+DESCRIPTION
+====================
+Benchmark of sampling many debounced switches.
+
+PINS switches are updated ROUNDS times: once the usual way, where each
+Bounce takes its level and millis() and times its own debounce, and once
+through a PortScanner that reads and debounces each port of 8 switches
+at once per round and hands every Bounce its level.
+
+Both runs read the same simulated ports, bytes in RAM that are toggled
+the same way between rounds, so they debounce the same levels, the
+benchmark needs no wiring and it also runs against host stubs of the
+Arduino core. Only the debouncing is compared: the polled switches skip
+the digitalRead() a real pin would cost them.
+
+Results are reported through serial (115200 baud) in microseconds per
+switch and round.
+
+*/
+
+#include <Bounce2.h>
+
+#define PINS 64
+#define ROUNDS 200
+
+volatile uint8_t simulatedPorts[PINS / 8];
+
+Bounce polled[PINS];
+Bounce scanned[PINS];
+int8_t ports[PINS];
+uint8_t masks[PINS];
+
+PortScanner scanner;
+
+unsigned long changes;
+
+void resetPorts() {
+  for (int p = 0; p < PINS / 8; p++)
+    simulatedPorts[p] = 0;
+}
+
+// one switch per port flips every round
+void flipPort(int round) {
+  simulatedPorts[round % (PINS / 8)] ^= 1 << (round % 8);
+}
+
+float measurePolled() {
+  changes = 0;
+  resetPorts();
+  unsigned long t = micros();
+  for (int r = 0; r < ROUNDS; r++) {
+    flipPort(r);
+
+    for (int i = 0; i < PINS; i++) {
+      if (polled[i].update(simulatedPorts[i / 8] & masks[i], millis()))
+        changes++;
+    }
+  }
+  return (float)(micros() - t) / ROUNDS / PINS;
+}
+
+float measureScanned() {
+  changes = 0;
+  resetPorts();
+  unsigned long t = micros();
+  for (int r = 0; r < ROUNDS; r++) {
+    flipPort(r);
+
+    scanner.scan();
+    for (int i = 0; i < PINS; i++) {
+      if (scanned[i].set(scanner.read(ports[i], masks[i])))
+        changes++;
+    }
+  }
+  return (float)(micros() - t) / ROUNDS / PINS;
+}
+
+void setup() {
+  Serial.begin(115200);
+
+  for (int i = 0; i < PINS; i++) {
+    polled[i].interval(0);
+
+    ports[i] = scanner.attach(&simulatedPorts[i / 8]);
+    masks[i] = 1 << (i % 8);
+  }
+
+  Serial.print("polled=");
+  Serial.print(measurePolled());
+  Serial.print(" changes=");
+  Serial.print(changes);
+  Serial.print(" scanned=");
+  Serial.print(measureScanned());
+  Serial.print(" changes=");
+  Serial.println(changes);
+}
+
+void loop() {
+}
@@ -64,9 +64,12 @@ void StreamPrint_progmem(Print &out,PGM_P format,...)
 #endif
 
 
-EventManager::EventManager( SafetyMode safety ) : 
-mHighPriorityQueue( ( safety == EventManager::kInterruptSafe ) ), 
-mLowPriorityQueue( ( safety == EventManager::kInterruptSafe ) )
+EventParamPool<EventParam> EventParam::pool( EVENTMANAGER_PARAM_POOL_SIZE );
+
+
+EventManager::EventManager( SafetyMode safety, int queueSize, int timerSize ) : 
+mHighPriorityQueue( ( safety == EventManager::kInterruptSafe ), queueSize, timerSize ), 
+mLowPriorityQueue( ( safety == EventManager::kInterruptSafe ), queueSize, timerSize )
 {
 }
 
@@ -128,16 +131,50 @@ int EventManager::processAllEvents()
 
 
 
+int EventManager::processEvents( int maxCount, unsigned long maxMicros )
+{
+    EventQueue::EventElement event;
+    unsigned long start = micros();
+    int count = 0;
+
+    while ( mHighPriorityQueue.popEvent( &event ) || mLowPriorityQueue.popEvent( &event ) )
+    {
+        mListeners.sendEvent( event.code, event.param );
+
+        EVTMGR_DEBUG_PRINT( "processEvents() event %d, %d", event.code, event.param );
+
+        delete event.param;
+
+        if ( ++count == maxCount )
+        {
+            break;
+        }
+        if ( maxMicros && micros() - start >= maxMicros )
+        {
+            break;
+        }
+    }
+
+    return mHighPriorityQueue.getNumEvents() + mLowPriorityQueue.getNumEvents();
+}
+
+
+
 /********************************************************************/
 
 
 
 EventManager::ListenerList::ListenerList() : 
-mNumListeners( 0 ), mDefaultCallback( 0 )
+mNumListeners( 0 ), mTable( 0 ), mTableFirst( 0 ), mTableSize( 0 ), mDefaultCallback( 0 )
 {
     mListeners.reserve(kMaxListeners);
 }
 
+EventManager::ListenerList::~ListenerList()
+{
+    delete[] mTable;
+}
+
 int EventManager::ListenerList::numListeners()
 {
     return mListeners.size();
@@ -148,22 +185,24 @@ int EventManager::numListeners()
     return mListeners.numListeners();
 }
 
-boolean EventManager::ListenerList::addListener( int eventCode, EventListener* listener ) 
+boolean EventManager::ListenerList::addListener( int firstCode, int lastCode, EventListener* listener ) 
 {
-    EVTMGR_DEBUG_PRINT( "addListener() enter %d, ", eventCode );
+    EVTMGR_DEBUG_PRINT( "addListener() enter %d-%d, ", firstCode, lastCode );
     EVTMGR_DEBUG_PRINTLN_PTR( listener )
 
     // Argument check
-    if ( !listener ) 
+    if ( !listener || lastCode < firstCode ) 
     {
         return false;
     }
 
     ListenerItem item;
     item.callback  = listener;
-    item.eventCode = eventCode;
+    item.eventCode = firstCode;
+    item.lastCode  = lastCode;
     item.enabled   = true;
     mListeners.push_back(item);
+    updateTable();
 
     EVTMGR_DEBUG_PRINT( "addListener() listener added\n" )
 
@@ -171,6 +210,49 @@ boolean EventManager::ListenerList::addListener( int eventCode, EventListener* l
 }
 
 
+boolean EventManager::ListenerList::setDispatchTable( int firstCode, int numCodes )
+{
+    unsigned int *table = ( numCodes > 0 ) ? new unsigned int[numCodes] : 0;
+    if ( numCodes > 0 && !table )
+    {
+        return false;
+    }
+
+    delete[] mTable;
+    mTable = table;
+    mTableFirst = firstCode;
+    mTableSize = table ? numCodes : 0;
+    updateTable();
+
+    return true;
+}
+
+
+void EventManager::ListenerList::updateTable()
+{
+    for ( int code = 0; code < mTableSize; code++ )
+    {
+        mTable[code] = 0;
+    }
+
+    int i = 0;
+    for(SimpleList<ListenerItem>::iterator itr = mListeners.begin(); itr != mListeners.end() && i < kTableListeners; ++itr, ++i)
+    {
+        if ( !itr->callback || !itr->enabled )
+        {
+            continue;
+        }
+
+        int first = itr->eventCode - mTableFirst;
+        int last = itr->lastCode - mTableFirst;
+        for ( int code = ( first > 0 ? first : 0 ); code <= last && code < mTableSize; code++ )
+        {
+            mTable[code] |= ( 1U << i );
+        }
+    }
+}
+
+
 boolean EventManager::ListenerList::removeListener( int eventCode, EventListener* listener ) 
 {
     EVTMGR_DEBUG_PRINT( "removeListener() enter %d, ", eventCode );
@@ -187,6 +269,7 @@ boolean EventManager::ListenerList::removeListener( int eventCode, EventListener
         if(itr->eventCode == eventCode && itr->callback == listener)
         {
             mListeners.erase(itr);
+            updateTable();
             EVTMGR_DEBUG_PRINT( "removeListener() removed\n" )
             return true;
         }
@@ -217,6 +300,11 @@ int EventManager::ListenerList::removeListener( EventListener* listener )
             removed++;
         }
     }
+
+    if ( removed )
+    {
+        updateTable();
+    }
     
     EVTMGR_DEBUG_PRINT( "  removeListener() removed " )
     EVTMGR_DEBUG_PRINT( "%d\n", removed )
@@ -242,6 +330,7 @@ boolean EventManager::ListenerList::enableListener( int eventCode, EventListener
         if(itr->eventCode == eventCode && itr->callback == listener)
         {
             itr->enabled = enable;
+            updateTable();
             EVTMGR_DEBUG_PRINT( "enableListener() success\n" )
             return true;
         }
@@ -277,9 +366,29 @@ int EventManager::ListenerList::sendEvent( int eventCode, EventParam *param )
     EVTMGR_DEBUG_PRINTLN_PTR( param )
 
     int handlerCount = 0;
-    for(SimpleList<ListenerItem>::iterator itr = mListeners.begin(); itr != mListeners.end(); ++itr)
+    SimpleList<ListenerItem>::iterator itr = mListeners.begin();
+
+    unsigned int slot = eventCode - mTableFirst;
+    if ( slot < (unsigned int)mTableSize )
+    {
+        // Listeners held in the table are called straight from the code's entry,
+        // only those past the table width are left to scan
+        unsigned int listeners = mTable[slot];
+        for ( int i = 0; listeners; i++, listeners >>= 1 )
+        {
+            if ( listeners & 1 )
+            {
+                handlerCount++;
+                (*itr[i].callback)( eventCode, param );
+            }
+        }
+
+        itr += ( (int)mListeners.size() < kTableListeners ) ? mListeners.size() : kTableListeners;
+    }
+
+    for( ; itr != mListeners.end(); ++itr)
     {
-        if ( ( itr->callback != 0 ) && ( itr->eventCode == eventCode ) && itr->enabled )
+        if ( ( itr->callback != 0 ) && ( itr->eventCode <= eventCode ) && ( eventCode <= itr->lastCode ) && itr->enabled )
         {
             handlerCount++;
             (*itr->callback)( eventCode, param );
@@ -351,20 +460,90 @@ int EventManager::ListenerList::callDefaultListener(int eventCode, EventParam *p
 
 
 
-EventManager::EventQueue::EventQueue( boolean beSafe ) :
+EventManager::EventQueue::EventQueue( boolean beSafe, int size, int timerSize ) :
+mRing( new RingElement[size] ),
+mSize( size ),
+mHead( 0 ),
+mCount( 0 ),
+mTimers( timerSize ? new EventElement[timerSize] : 0 ),
+mTimerSize( timerSize ),
+mNumTimers( 0 ),
+mOverflows( 0 ),
+mCoalescer( 0 ),
+mCoalesced( 0 ),
+mHighWater( 0 ),
+mEnqueued( 0 ),
+mDispatched( 0 ),
+mMaxDwell( 0 ),
+mTotalDwell( 0 ),
 mInterruptSafeMode( beSafe )
 {
-    mEventQueue.reserve(kEventQueueSize);
+    if ( !mRing )
+    {
+        mSize = 0;
+    }
+    if ( !mTimers )
+    {
+        mTimerSize = 0;
+    }
 }
 
 
+EventManager::EventQueue::~EventQueue()
+{
+    delete[] mRing;
+    delete[] mTimers;
+}
+
 
-boolean EventManager::EventQueue::queueEvent(int eventCode, int eventParam, uint32_t eventTime)
-{  
-    return queueEvent(eventCode, new EventParam(eventParam), eventTime);
+void EventManager::EventQueue::pushTimer( const EventElement &event )
+{
+    // Sift the new element up from the last leaf
+    int i = mNumTimers++;
+    while ( i > 0 )
+    {
+        int parent = ( i - 1 ) / 2;
+        if ( !isBefore( event.time, mTimers[parent].time ) )
+        {
+            break;
+        }
+        mTimers[i] = mTimers[parent];
+        i = parent;
+    }
+    mTimers[i] = event;
 }
 
-boolean EventManager::EventQueue::queueEvent(int eventCode, EventParam *eventParam, uint32_t eventTime)
+
+void EventManager::EventQueue::popTimer( EventElement *event )
+{
+    *event = mTimers[0];
+
+    // Sift the last leaf down from the root
+    EventElement last = mTimers[--mNumTimers];
+    int i = 0;
+    for (;;)
+    {
+        int child = 2 * i + 1;
+        if ( child >= mNumTimers )
+        {
+            break;
+        }
+        if ( child + 1 < mNumTimers && isBefore( mTimers[child + 1].time, mTimers[child].time ) )
+        {
+            child++;
+        }
+        if ( !isBefore( mTimers[child].time, last.time ) )
+        {
+            break;
+        }
+        mTimers[i] = mTimers[child];
+        i = child;
+    }
+    mTimers[i] = last;
+}
+
+
+boolean EventManager::EventQueue::queueEvent(int eventCode, EventParam *eventParam, unsigned int delay)
 {
     /*
     * The call to noInterrupts() MUST come BEFORE the full queue check.
@@ -399,6 +578,9 @@ boolean EventManager::EventQueue::queueEvent(int eventCode, EventParam *eventPar
     }
 #endif
 
+    unsigned long now = millis();
+    unsigned long eventTime = delay ? now + delay : 0;
+
     uint8_t sregSave;
     if ( mInterruptSafeMode )
     {
@@ -409,14 +591,56 @@ boolean EventManager::EventQueue::queueEvent(int eventCode, EventParam *eventPar
     }
 
     // ATOMIC BLOCK BEGIN (only atomic **if** mInterruptSafeMode is on)
-    EventElement event;
+    boolean retVal = false;
+    boolean coalesced = false;
+
+    if ( !delay )
+    {
+        if ( mCoalescer && coalesce( eventCode, eventParam ) )
+        {
+            // The parameter is deleted below, outside the atomic section
+            coalesced = true;
+            retVal = true;
+        }
+        else if ( mCount < mSize )
+        {
+            int tail = mHead + mCount;
+            if ( tail >= mSize )
+            {
+                tail -= mSize;
+            }
+
+            mRing[tail].code  = eventCode;
+            mRing[tail].param = eventParam;
+            mRing[tail].time  = now;
+            mCount++;
+            retVal = true;
+        }
+    }
+    else if ( mNumTimers < mTimerSize )
+    {
+        EventElement event;
 
-    event.code  = eventCode;
-    event.param = eventParam;
-    event.time  = eventTime;
+        event.code  = eventCode;
+        event.param = eventParam;
+        event.time  = eventTime;
+
+        pushTimer( event );
+        retVal = true;
+    }
 
-    mEventQueue.push_back(event);
-    boolean retVal = true;
+    if ( retVal )
+    {
+        mEnqueued++;
+        if ( mCount + mNumTimers > mHighWater )
+        {
+            mHighWater = mCount + mNumTimers;
+        }
+    }
+    else
+    {
+        mOverflows++;
+    }
     // ATOMIC BLOCK END
 
     if ( mInterruptSafeMode )
@@ -425,6 +649,11 @@ boolean EventManager::EventQueue::queueEvent(int eventCode, EventParam *eventPar
         __iRestore( &sregSave );
     }
 
+    if ( coalesced )
+    {
+        delete eventParam;
+    }
+
 #if EVENTMANAGER_DEBUG
     if ( !mInterruptSafeMode )
     {
@@ -440,6 +669,70 @@ boolean EventManager::EventQueue::queueEvent(int eventCode, EventParam *eventPar
 }
 
 
+void EventManager::EventQueue::getStats( QueueStats *stats )
+{
+    uint8_t sregSave = SREG;
+    cli();
+
+    stats->size = mSize;
+    stats->timerSize = mTimerSize;
+    stats->depth = mCount + mNumTimers;
+    stats->highWater = mHighWater;
+    stats->enqueued = mEnqueued;
+    stats->dropped = mOverflows;
+    stats->coalesced = mCoalesced;
+    stats->dispatched = mDispatched;
+    stats->maxDwell = mMaxDwell;
+    stats->totalDwell = mTotalDwell;
+
+    __iRestore( &sregSave );
+}
+
+
+void EventManager::EventQueue::resetStats()
+{
+    uint8_t sregSave = SREG;
+    cli();
+
+    mHighWater = mCount + mNumTimers;
+    mEnqueued = 0;
+    mOverflows = 0;
+    mCoalesced = 0;
+    mDispatched = 0;
+    mMaxDwell = 0;
+    mTotalDwell = 0;
+
+    __iRestore( &sregSave );
+}
+
+
+boolean EventManager::EventQueue::coalesce( int eventCode, EventParam *eventParam )
+{
+    // Walk the pending immediate events from the newest one back
+    for ( int n = mCount - 1; n >= 0; n-- )
+    {
+        int i = mHead + n;
+        if ( i >= mSize )
+        {
+            i -= mSize;
+        }
+
+        EventCoalescer::Result result = mCoalescer->coalesce( mRing[i].code, mRing[i].param, eventCode, eventParam );
+        if ( result == EventCoalescer::kMerged )
+        {
+            mCoalesced++;
+            return true;
+        }
+        if ( result == EventCoalescer::kBlocked )
+        {
+            break;
+        }
+    }
+
+    return false;
+}
+
+
 boolean EventManager::EventQueue::popEvent( EventElement *event )
 {
     /*
@@ -465,6 +758,9 @@ boolean EventManager::EventQueue::popEvent( EventElement *event )
     {
         return false;
     }
+
+    unsigned long now = millis();
+    unsigned int dwell = 0;
     
     if ( mInterruptSafeMode )
     {
@@ -472,21 +768,36 @@ boolean EventManager::EventQueue::popEvent( EventElement *event )
         cli();
     }
 
+    // The earliest delayed event goes first once it is due and was due no
+    // later than the oldest immediate event was queued, so a steady stream
+    // of immediate events cannot hold it back
+    bool timerDue = mNumTimers && !isBefore( now, mTimers[0].time );
+    if ( timerDue && mCount )
+    {
+        timerDue = now - mTimers[0].time >= (unsigned int)( (unsigned int)now - mRing[mHead].time );
+    }
+
     bool found = false;
-    for(SimpleList<EventElement>::iterator itr = mEventQueue.begin(); itr != mEventQueue.end(); ++itr)
+    if ( timerDue )
+    {
+        popTimer( event );
+        dwell = now - event->time;
+        found = true;
+    }
+    else if ( mCount )
     {
-        if(itr->time <= millis())
+        event->code  = mRing[mHead].code;
+        event->param = mRing[mHead].param;
+        event->time  = 0;
+        dwell = (unsigned int)now - mRing[mHead].time;
+
+        if ( ++mHead == mSize )
         {
-            event->code = itr->code;
-            event->param = itr->param;
-            event->time = itr->time;
-            mEventQueue.erase(itr);
-            found = true;
-            break;
+            mHead = 0;
         }
+        mCount--;
+        found = true;
     }
-    if(!found)
-        return false;
 
     if ( mInterruptSafeMode )
     {
@@ -496,6 +807,18 @@ boolean EventManager::EventQueue::popEvent( EventElement *event )
         EVTMGR_DEBUG_PRINT( "popEvent() interrupts on\n" )
     }
 
+    if ( !found )
+    {
+        return false;
+    }
+
+    mDispatched++;
+    mTotalDwell += dwell;
+    if ( dwell > mMaxDwell )
+    {
+        mMaxDwell = dwell;
+    }
+
     EVTMGR_DEBUG_PRINT( "popEvent() return %d, ", event->code)
     EVTMGR_DEBUG_PRINTLN_PTR( event->param)
 
@@ -56,14 +56,65 @@ void StreamPrint_progmem(Print &out,PGM_P format,...);
 #define EVENTMANAGER_LISTENER_LIST_SIZE		4
 #endif
 
-// Size of the event two queues.  Adjust as appropriate for your application.
-// Requires a total of 4 * sizeof(int) bytes of RAM for each unit of size 
+// Default size of the two event queues.  Adjust as appropriate for your application.
+// Requires a total of 4 * sizeof(int) bytes of RAM for each unit of size.
+// The library is compiled separately from the sketch, so a value defined in the
+// sketch only takes effect through the default argument of the EventManager constructor.
 #ifndef EVENTMANAGER_EVENT_QUEUE_SIZE
 #define EVENTMANAGER_EVENT_QUEUE_SIZE		4
 #endif
 
+// Default number of delayed events each of the two queues can hold.
+// Requires 2 * sizeof(int) + sizeof(long) bytes of RAM for each unit of size.
+#ifndef EVENTMANAGER_TIMER_QUEUE_SIZE
+#define EVENTMANAGER_TIMER_QUEUE_SIZE		4
+#endif
+
+// Number of EventParam objects preallocated for queued events.
+// The pool is compiled into the library, so this has to be changed here.
+#ifndef EVENTMANAGER_PARAM_POOL_SIZE
+#define EVENTMANAGER_PARAM_POOL_SIZE		16
+#endif
+
 //#define EVENTMANAGER_DEBUG 1
 
+// Fixed pool of numBlocks objects of type T, allocated once when the pool is
+// constructed.  Allocating and releasing is O(1) and interrupt safe.  When the
+// pool is exhausted, or asked for an object larger than T, the heap is used
+// instead and counted in getNumFallbacks().
+template<class T>
+class EventParamPool
+{
+public:
+    EventParamPool( int numBlocks );
+
+    void *allocate( size_t size );
+    void release( void *p );
+
+    int getNumFree();
+    unsigned int getNumFallbacks();
+
+private:
+    union Block
+    {
+        Block *next;
+        uint8_t data[sizeof(T)];
+    };
+
+    Block *mBlocks;
+    Block *mFree;
+    int mNumBlocks;
+    volatile int mNumFree;
+    volatile unsigned int mFallbacks;
+};
+
+// Gives an EventParam class its own pool: new and delete of T go through
+// T::pool, which has to be defined once as "EventParamPool<T> T::pool( size );"
+#define EVENTPARAM_POOLED( T ) \
+    static EventParamPool<T> pool; \
+    static void *operator new( size_t size ) { return pool.allocate( size ); } \
+    static void operator delete( void *p ) { pool.release( p ); }
+
 class EventParam
 {
 public:
@@ -71,6 +122,12 @@ public:
     EventParam(void *sender, int param) : param(param), sender(sender) {}
     EventParam(int param): param(param) {}
     EventParam(void *sender) : sender(sender) {}
+
+    // Virtual, so that deleting a derived parameter returns it to its own pool
+    virtual ~EventParam() {}
+
+    EVENTPARAM_POOLED( EventParam )
+
     void *sender;
     int param;
 };
@@ -80,6 +137,22 @@ public:
     virtual void operator()( int eventCode, EventParam *eventParam )=0;
 };
 
+// Merges a new event into one already queued.  Once installed with
+// EventManager::setCoalescer(), it is offered the pending immediate events,
+// newest first, whenever an immediate event is queued.
+class EventCoalescer{
+public:
+    enum Result {
+        kUnrelated,     // keep looking at older events
+        kMerged,        // the queued event now stands for both, the new one is dropped
+        kBlocked        // the new event has to be queued on its own
+    };
+
+    // queuedCode and queued may be changed in place when merging
+    // In interrupt safe mode this runs with interrupts disabled
+    virtual Result coalesce( int &queuedCode, EventParam *queued, int eventCode, EventParam *eventParam )=0;
+};
+
 template<typename F>
 class GenericCallable : public EventListener
 {
@@ -199,12 +272,31 @@ public:
     
     // Create an event manager
     // By default, it operates in interrupt safe mode, allowing you to queue events from interrupt handlers
-    EventManager( SafetyMode safety = kInterruptSafe );
+    // Each of the two queues holds up to queueSize immediate and timerSize delayed events
+    EventManager( SafetyMode safety = kInterruptSafe, int queueSize = EVENTMANAGER_EVENT_QUEUE_SIZE,
+                  int timerSize = EVENTMANAGER_TIMER_QUEUE_SIZE );
 
     // Add a listener
     // Returns true if the listener is successfully installed, false otherwise (e.g. the dispatch table is full)
     boolean addListener( int eventCode, EventListener* listener );
 
+    // Add a listener for every code from firstCode to lastCode
+    // The range is referred to by firstCode when removing or enabling the listener
+    boolean addListener( int firstCode, int lastCode, EventListener* listener );
+
+    // Dispatch the numCodes codes starting at firstCode through a table indexed by code,
+    // so sending them costs the same however many codes are registered.  Meant for small
+    // dense ranges such as enums; requires sizeof(int) bytes of RAM for each code.
+    // Only the first 16 listeners are held in the table, later ones are scanned.
+    boolean setDispatchTable( int firstCode, int numCodes );
+
+    // Merge newly queued immediate events into pending ones through coalescer,
+    // 0 turns coalescing off.  Off by default.
+    void setCoalescer( EventCoalescer *coalescer );
+
+    // Number of events merged into pending ones
+    unsigned int getNumCoalesced( EventPriority pri = kLowPriority );
+
     // Remove (event, listener) pair (all occurrences)
     // Other listeners with the same function or event code will not be affected
     boolean removeListener( int eventCode, EventListener* listener );
@@ -242,12 +334,41 @@ public:
     // Returns true if no events are in the queue
     boolean isEventQueueEmpty( EventPriority pri = kLowPriority );
 
+    // Returns true if no more events can be queued
+    boolean isEventQueueFull( EventPriority pri = kLowPriority );
+
     // Actual number of events in queue
     int getNumEventsInQueue( EventPriority pri = kLowPriority );
 
+    // Number of events dropped because the queue was full
+    unsigned int getNumOverflows( EventPriority pri = kLowPriority );
+
+    // Counters kept for each queue, cheap enough to leave on.  Times are in milliseconds.
+    // Immediate events wait from queueing to dispatch, delayed ones from their due time.
+    struct QueueStats
+    {
+        int size;                   // capacity for immediate events
+        int timerSize;              // capacity for delayed events
+        int depth;                  // events waiting now
+        int highWater;              // most events waiting at once
+        unsigned long enqueued;     // events accepted, merged ones included
+        unsigned int dropped;       // events lost because the queue was full
+        unsigned int coalesced;     // events merged into pending ones
+        unsigned long dispatched;   // events taken out of the queue
+        unsigned int maxDwell;      // longest wait
+        unsigned long totalDwell;   // sum of waits, divided by dispatched gives the mean
+    };
+
+    // Copies the counters of a queue
+    void getQueueStats( QueueStats *stats, EventPriority pri = kLowPriority );
+
+    // Clears the counters of both queues, the high-water marks restart at the current depth
+    void resetQueueStats();
+
     // tries to insert an event into the queue;
     // returns true if successful, false if the
     // queue if full and the event cannot be inserted
+    // The queue owns eventParam from here on, it is deleted if the event is dropped
     boolean queueEvent( int eventCode, int eventParam, unsigned int delay = 0, EventPriority pri = kLowPriority );
     boolean queueEvent( int eventCode, EventParam *eventParam, unsigned int delay = 0, EventPriority pri = kLowPriority );
 
@@ -259,6 +380,12 @@ public:
     // this function might never return.  YOU HAVE BEEN WARNED.
     int processAllEvents();
 
+    // this function processes events, high priority ones first, until maxCount events
+    // have been processed or maxMicros microseconds have passed, whichever comes first;
+    // at least one event is processed if any is due, a limit of 0 means no limit
+    // returns the number of events left in the queues, delayed ones included
+    int processEvents( int maxCount, unsigned long maxMicros = 0 );
+
 
 private:  
     
@@ -272,41 +399,86 @@ private:
         {
             int code;	// each event is represented by an integer code
             EventParam *param;	// each event has a single integer parameter
-            unsigned long time;
+            unsigned long time;	// due time of delayed events, 0 for immediate ones
         };
 
         // Queue constructor
-        EventQueue( boolean beSafe );
+        EventQueue( boolean beSafe, int size, int timerSize );
+        ~EventQueue();
 
         // Returns true if no events are in the queue
         boolean isEmpty();
 
+        // Returns true if no more events can be queued
+        boolean isFull();
+
         // Actual number of events in queue
         int getNumEvents();
 
+        // Number of events dropped because the queue was full
+        unsigned int getNumOverflows();
+
+        void getStats( QueueStats *stats );
+        void resetStats();
+
+        void setCoalescer( EventCoalescer *coalescer );
+        unsigned int getNumCoalesced();
+
         // Tries to insert an event into the queue;
         // Returns true if successful, false if the queue if full and the event cannot be inserted
+        // An event merged into a pending one counts as inserted, its parameter is deleted
         //
         // NOTE: if EventManager is instantiated in interrupt safe mode, this function can be called
         // from interrupt handlers.  This is the ONLY EventManager function that can be called from
         // an interrupt.
-        boolean queueEvent( int eventCode, int eventParam, unsigned long eventTime );
-        boolean queueEvent(int eventCode, EventParam *eventParam, unsigned long eventTime );
+        boolean queueEvent( int eventCode, EventParam *eventParam, unsigned int delay );
 
         // Tries to extract an event from the queue;
         // Returns true if successful, false if the queue is empty (the parameteres are not touched in this case)
         boolean popEvent(EventElement *event);
 
     private:
-    
-        // Event queue size.
-        // The maximum number of events the queue can hold is kEventQueueSize
-        // Increasing this number will consume 2 * sizeof(int) bytes of RAM for each unit.
-        static const int kEventQueueSize = EVENTMANAGER_EVENT_QUEUE_SIZE;
 
-        // The event queue
-        SimpleList<EventElement> mEventQueue;
-        
+        struct RingElement
+        {
+            int code;
+            EventParam *param;
+            unsigned int time;  // low bits of millis() when queued
+        };
+
+        // Immediate events, a ring of mSize elements starting at mHead.
+        // Queueing and popping them is O(1) and never allocates.
+        RingElement *mRing;
+        int mSize;
+        volatile int mHead;
+        volatile int mCount;
+
+        // Delayed events, a binary min-heap of mTimerSize elements on the due time.
+        // Inserting and expiring are O(log n), checking for a due event is O(1).
+        // Due times are compared by their difference, which survives the millis() rollover
+        // as long as no delay exceeds half its range.
+        EventElement *mTimers;
+        int mTimerSize;
+        volatile int mNumTimers;
+
+        static boolean isBefore( unsigned long a, unsigned long b );
+        void pushTimer( const EventElement &event );
+        void popTimer( EventElement *event );
+
+        volatile unsigned int mOverflows;
+
+        EventCoalescer *mCoalescer;
+        unsigned int mCoalesced;
+
+        // Statistics, the queueing side ones are updated inside the atomic section
+        volatile int mHighWater;
+        volatile unsigned long mEnqueued;
+        unsigned long mDispatched;
+        unsigned int mMaxDwell;
+        unsigned long mTotalDwell;
+
+        boolean coalesce( int eventCode, EventParam *eventParam );
+
         // Whether we should be interrupt safe
         boolean mInterruptSafeMode;
     };
@@ -320,10 +492,13 @@ private:
 
         // Create an event manager
         ListenerList();
+        ~ListenerList();
 
         // Add a listener
         // Returns true if the listener is successfully installed, false otherwise (e.g. the dispatch table is full)
-        boolean addListener( int eventCode, EventListener* listener );
+        boolean addListener( int firstCode, int lastCode, EventListener* listener );
+
+        boolean setDispatchTable( int firstCode, int numCodes );
 
         // Remove event listener pair (all occurrences)
         // Other listeners with the same function or eventCode will not be affected
@@ -367,11 +542,23 @@ private:
         {
 //            ListenerItem(EventListener* _callback,int _eventCode,boolean _enabled): callback(_callback),eventCode(_eventCode),enabled(_enabled) {};
             EventListener*	callback;		// The listener function
-            int				eventCode;		// The event code
+            int				eventCode;		// The event code, first one of the range
+            int				lastCode;		// The last event code of the range
             boolean			enabled;			// Each listener can be enabled or disabled
         };
         SimpleList<ListenerItem> mListeners;
 
+        // Listeners held in each dispatch table entry, one bit each
+        static const int kTableListeners = 16;
+
+        // Dispatch table: for each code from mTableFirst on, the bit set of
+        // enabled listeners registered for it.  Rebuilt whenever listeners change.
+        unsigned int *mTable;
+        int mTableFirst;
+        int mTableSize;
+
+        void updateTable();
+
         // Callback function to be called for event types which have no listener
         EventListener* mDefaultCallback;
 
@@ -393,7 +580,28 @@ private:
 
 inline boolean EventManager::addListener( int eventCode, EventListener* listener )
 { 
-    return mListeners.addListener( eventCode, listener ); 
+    return mListeners.addListener( eventCode, eventCode, listener ); 
+}
+
+inline boolean EventManager::addListener( int firstCode, int lastCode, EventListener* listener )
+{
+    return mListeners.addListener( firstCode, lastCode, listener );
+}
+
+inline boolean EventManager::setDispatchTable( int firstCode, int numCodes )
+{
+    return mListeners.setDispatchTable( firstCode, numCodes );
+}
+
+inline void EventManager::setCoalescer( EventCoalescer *coalescer )
+{
+    mHighPriorityQueue.setCoalescer( coalescer );
+    mLowPriorityQueue.setCoalescer( coalescer );
+}
+
+inline unsigned int EventManager::getNumCoalesced( EventPriority pri )
+{
+    return ( pri == kHighPriority ) ? mHighPriorityQueue.getNumCoalesced() : mLowPriorityQueue.getNumCoalesced();
 }
 
 inline boolean EventManager::removeListener( int eventCode, EventListener* listener )
@@ -451,23 +659,47 @@ inline boolean EventManager::isEventQueueEmpty( EventPriority pri )
     return ( pri == kHighPriority ) ? mHighPriorityQueue.isEmpty() : mLowPriorityQueue.isEmpty(); 
 }
 
+inline boolean EventManager::isEventQueueFull( EventPriority pri )
+{
+    return ( pri == kHighPriority ) ? mHighPriorityQueue.isFull() : mLowPriorityQueue.isFull();
+}
+
 inline int EventManager::getNumEventsInQueue( EventPriority pri ) 
 { 
     return ( pri == kHighPriority ) ? mHighPriorityQueue.getNumEvents() : mLowPriorityQueue.getNumEvents(); 
 }
 
+inline unsigned int EventManager::getNumOverflows( EventPriority pri )
+{
+    return ( pri == kHighPriority ) ? mHighPriorityQueue.getNumOverflows() : mLowPriorityQueue.getNumOverflows();
+}
+
+inline void EventManager::getQueueStats( QueueStats *stats, EventPriority pri )
+{
+    if ( pri == kHighPriority )
+        mHighPriorityQueue.getStats( stats );
+    else
+        mLowPriorityQueue.getStats( stats );
+}
+
+inline void EventManager::resetQueueStats()
+{
+    mHighPriorityQueue.resetStats();
+    mLowPriorityQueue.resetStats();
+}
+
 inline boolean EventManager::queueEvent( int eventCode, int eventParam, unsigned int delay, EventPriority pri )
 { 
-    unsigned long eventTime = millis() + delay;
-    return ( pri == kHighPriority ) ? 
-        mHighPriorityQueue.queueEvent( eventCode, eventParam, eventTime ) : mLowPriorityQueue.queueEvent( eventCode, eventParam, eventTime );
+    return queueEvent( eventCode, new EventParam( eventParam ), delay, pri );
 }
 
 inline boolean EventManager::queueEvent( int eventCode, EventParam *eventParam, unsigned int delay, EventManager::EventPriority pri )
 {
-    unsigned long eventTime = millis() + delay;
-    return ( pri == kHighPriority ) ?
-        mHighPriorityQueue.queueEvent( eventCode, eventParam, eventTime ) : mLowPriorityQueue.queueEvent( eventCode, eventParam, eventTime );
+    boolean queued = ( pri == kHighPriority ) ?
+        mHighPriorityQueue.queueEvent( eventCode, eventParam, delay ) : mLowPriorityQueue.queueEvent( eventCode, eventParam, delay );
+    if ( !queued )
+        delete eventParam;
+    return queued;
 }
 
 
@@ -476,13 +708,122 @@ inline boolean EventManager::queueEvent( int eventCode, EventParam *eventParam,
 
 inline boolean EventManager::EventQueue::isEmpty() 
 {
-    return ( mEventQueue.empty() );
+    return ( !mCount && !mNumTimers );
+}
+
+
+inline boolean EventManager::EventQueue::isFull()
+{
+    return ( mCount >= mSize );
 }
 
 
 inline int EventManager::EventQueue::getNumEvents() 
 {
-    return mEventQueue.size();
+    return mCount + mNumTimers;
+}
+
+
+inline unsigned int EventManager::EventQueue::getNumOverflows()
+{
+    return mOverflows;
+}
+
+
+inline void EventManager::EventQueue::setCoalescer( EventCoalescer *coalescer )
+{
+    mCoalescer = coalescer;
+}
+
+
+inline unsigned int EventManager::EventQueue::getNumCoalesced()
+{
+    return mCoalesced;
+}
+
+
+inline boolean EventManager::EventQueue::isBefore( unsigned long a, unsigned long b )
+{
+    return ( (long)( a - b ) < 0 );
+}
+
+
+
+//*********  INLINES   EventParamPool::  ***********
+
+template<class T>
+EventParamPool<T>::EventParamPool( int numBlocks ) :
+mBlocks( new Block[numBlocks] ),
+mFree( 0 ),
+mNumBlocks( numBlocks ),
+mNumFree( 0 ),
+mFallbacks( 0 )
+{
+    if ( !mBlocks )
+    {
+        mNumBlocks = 0;
+    }
+
+    for ( int i = mNumBlocks - 1; i >= 0; i-- )
+    {
+        mBlocks[i].next = mFree;
+        mFree = &mBlocks[i];
+    }
+    mNumFree = mNumBlocks;
+}
+
+template<class T>
+void *EventParamPool<T>::allocate( size_t size )
+{
+    uint8_t sregSave = SREG;
+    cli();
+
+    Block *block = ( size <= sizeof(T) ) ? mFree : 0;
+    if ( block )
+    {
+        mFree = block->next;
+        mNumFree--;
+    }
+    else
+    {
+        mFallbacks++;
+    }
+
+    SREG = sregSave;
+
+    return block ? (void *)block : ::operator new( size );
+}
+
+template<class T>
+void EventParamPool<T>::release( void *p )
+{
+    Block *block = (Block *)p;
+    if ( block < mBlocks || block >= mBlocks + mNumBlocks )
+    {
+        ::operator delete( p );
+        return;
+    }
+
+    uint8_t sregSave = SREG;
+    cli();
+
+    block->next = mFree;
+    mFree = block;
+    mNumFree++;
+
+    SREG = sregSave;
+}
+
+template<class T>
+inline int EventParamPool<T>::getNumFree()
+{
+    return mNumFree;
+}
+
+template<class T>
+inline unsigned int EventParamPool<T>::getNumFallbacks()
+{
+    return mFallbacks;
 }
 
 
@@ -0,0 +1,131 @@
+/**
+ * Benchmark of event queue throughput.
+ *
+ * 10000 events are queued and processed in bursts of BURST events: once
+ * through EventManager, whose queues are fixed rings, and once through a
+ * SimpleList queue that scans for the first due event and erases it, the
+ * way EventManager queued events before.
+ *
+ * A burst larger than the queue shows the overflow count instead of growing
+ * the queue.
+ *
+ * Neither queue holds more than 2 * BURST events at a time, so this compares
+ * the per-event cost of short queues only.  A 10000 deep comparison is ruled
+ * out by the ring's fixed capacity, and 10000 queued list entries and event
+ * parameters would not fit the RAM of the boards this runs on either.
+ *
+ * Results are printed in microseconds per event.
+ */
+
+#include <EventManager.h>
+
+#define EVENTS 10000
+#define BURST 16
+
+EventManager manager( EventManager::kNotInterruptSafe, BURST );
+
+volatile long handled = 0;
+
+void listener( int event, EventParam *param )
+{
+    handled += param->param;
+}
+
+GenericCallable<void(int, EventParam*)> callable( listener );
+
+struct ListEvent
+{
+    int code;
+    EventParam *param;
+    unsigned long time;
+};
+
+SimpleList<ListEvent> list;
+
+void listQueue( int code, EventParam *param )
+{
+    ListEvent event;
+    event.code = code;
+    event.param = param;
+    event.time = millis();
+    list.push_back( event );
+}
+
+void listProcessAll()
+{
+    for (;;)
+    {
+        bool found = false;
+        for ( SimpleList<ListEvent>::iterator itr = list.begin(); itr != list.end(); ++itr )
+        {
+            if ( itr->time <= millis() )
+            {
+                ListEvent event = *itr;
+                list.erase( itr );
+                listener( event.code, event.param );
+                delete event.param;
+                found = true;
+                break;
+            }
+        }
+        if ( !found )
+            return;
+    }
+}
+
+float measureRing( int burst )
+{
+    handled = 0;
+    unsigned long t = micros();
+    for ( int i = 0; i < EVENTS; i += burst )
+    {
+        for ( int j = 0; j < burst; j++ )
+            manager.queueEvent( EventManager::kEventUser0, new EventParam( 1 ) );
+        manager.processAllEvents();
+    }
+    return (float)( micros() - t ) / EVENTS;
+}
+
+float measureList( int burst )
+{
+    handled = 0;
+    unsigned long t = micros();
+    for ( int i = 0; i < EVENTS; i += burst )
+    {
+        for ( int j = 0; j < burst; j++ )
+            listQueue( EventManager::kEventUser0, new EventParam( 1 ) );
+        listProcessAll();
+    }
+    return (float)( micros() - t ) / EVENTS;
+}
+
+void benchmark( int burst )
+{
+    Serial.print( "burst " );
+    Serial.print( burst );
+    Serial.print( ": ring=" );
+    Serial.print( measureRing( burst ) );
+    Serial.print( " handled=" );
+    Serial.print( handled );
+    Serial.print( " list=" );
+    Serial.print( measureList( burst ) );
+    Serial.print( " handled=" );
+    Serial.print( handled );
+    Serial.print( " overflows=" );
+    Serial.println( manager.getNumOverflows() );
+}
+
+void setup()
+{
+    Serial.begin( 115200 );
+    manager.addListener( EventManager::kEventUser0, &callable );
+
+    benchmark( 1 );
+    benchmark( BURST / 2 );
+    benchmark( BURST );
+    benchmark( 2 * BURST );
+}
+
+void loop()
+{
+}
@@ -16,197 +16,561 @@ int eval_greater(int a1, int a2) { return a1 > a2 ? 1 : 0; }
 int eval_less(int a1, int a2) { return a1 < a2 ? 1 : 0; }
 int eval_ge(int a1, int a2) { return a1 >= a2 ? 1 : 0; }
 int eval_le(int a1, int a2) { return a1 <= a2 ? 1 : 0; }
+int eval_ne(int a1, int a2) { return a1 != a2 ? 1 : 0; }
+int eval_add(int a1, int a2) { return a1 + a2; }
+int eval_sub(int a1, int a2) { return a1 - a2; }
+int eval_mul(int a1, int a2) { return a1 * a2; }
+int eval_div(int a1, int a2) { return a2 ? a1 / a2 : 0; }
+int eval_mod(int a1, int a2) { return a2 ? a1 % a2 : 0; }
+int eval_neg(int a1, int a2) { return -a1; }
+int eval_min(int a1, int a2) { return a1 < a2 ? a1 : a2; }
+int eval_max(int a1, int a2) { return a1 > a2 ? a1 : a2; }
 
+/* 'g', 'l' and 'n' are ">=", "<=" and "!=", '~' is the unary minus,
+   'm' and 'M' are the functions min() and max() */
 operator_type operators[] = {
     {'&', 4, ASSOC_LEFT,  0, eval_and},
     {'|', 3, ASSOC_LEFT,  0, eval_or},
-    {'!', 8, ASSOC_RIGHT, 1, eval_not},
+    {'!', 9, ASSOC_RIGHT, 1, eval_not},
     {'=', 5, ASSOC_LEFT,  0, eval_equal},
     {'>', 6, ASSOC_LEFT,  0, eval_greater},
     {'<', 6, ASSOC_LEFT,  0, eval_less},
     {'g', 6, ASSOC_LEFT,  0, eval_ge},
     {'l', 6, ASSOC_LEFT,  0, eval_le},
-    {'(', 0, ASSOC_NONE,  0, NULL},
-    {')', 0, ASSOC_NONE,  0, NULL}
+    {'n', 5, ASSOC_LEFT,  0, eval_ne},
+    {'+', 7, ASSOC_LEFT,  0, eval_add},
+    {'-', 7, ASSOC_LEFT,  0, eval_sub},
+    {'*', 8, ASSOC_LEFT,  0, eval_mul},
+    {'/', 8, ASSOC_LEFT,  0, eval_div},
+    {'%', 8, ASSOC_LEFT,  0, eval_mod},
+    {'~', 9, ASSOC_RIGHT, 1, eval_neg},
+    {'m', 10, ASSOC_NONE, 0, eval_min},
+    {'M', 10, ASSOC_NONE, 0, eval_max},
+    {'(', 0, ASSOC_NONE,  0, NULL}
 };
 
 ExpressionEvaluator::ExpressionEvaluator(TokenEvaluator *ev)
     : tokenEvaluator(ev)
+    , resolver(NULL)
+    , code(NULL)
 {
 }
 
-operator_type *ExpressionEvaluator::getop(char ch) {
-    for(int i = 0; i < sizeof(operators) / sizeof(operator_type); ++i) {
+static operator_type *getop(char ch) {
+    for(unsigned i = 0; i < sizeof(operators) / sizeof(operator_type); ++i) {
         if(operators[i].op == ch)
             return &operators[i];
     }
     return NULL;
 }
 
-
-void ExpressionEvaluator::push_opstack(operator_type *op)
+/* Reads a binary operator, two character operators first */
+static operator_type *getbinop(const char *&p)
 {
-    if(nopstack > MAXOPSTACK - 1) {
-//        Serial.println("ERROR: Operator stack overflow");
-        return;
+    char ch = *p++;
+
+    if(*p == '=') {
+        switch(ch) {
+        case '>': ++p; return getop('g');
+        case '<': ++p; return getop('l');
+        case '!': ++p; return getop('n');
+        case '=': ++p; return getop('=');
+        }
     }
-    opstack[nopstack++] = op;
+
+    if(!strchr("&|=><+-*/%", ch))
+        return NULL;
+    return getop(ch);
 }
 
-operator_type *ExpressionEvaluator::pop_opstack()
+static operator_type *getfunction(const char *name, int len)
 {
-    if(!nopstack) {
-//        Serial.println("ERROR: Operator stack empty");
+    if(len != 3)
         return NULL;
-    }
-    return opstack[--nopstack];
+    if(!strncasecmp(name, "min", 3))
+        return getop('m');
+    if(!strncasecmp(name, "max", 3))
+        return getop('M');
+    return NULL;
 }
 
-void ExpressionEvaluator::push_numstack(int num)
+static bool is_function(operator_type *op)
 {
-    if(nnumstack > MAXNUMSTACK - 1) {
-//        Serial.println("ERROR: Number stack overflow");
-        return;
-    }
-    numstack[nnumstack++] = num;
+    return op->assoc == ASSOC_NONE && op->eval;
 }
 
-int ExpressionEvaluator::pop_numstack()
+static bool is_logical(operator_type *op, uint8_t flags)
 {
-    if(!nnumstack) {
-//        Serial.println("ERROR: Number stack empty");
+    return (flags & EXPR_SHORT_CIRCUIT) && (op->op == '&' || op->op == '|');
+}
+
+int ExpressionEvaluator::istoken_char(char c) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || isdigit(c) || (c == '_'))
+        return 1;
+    else
         return 0;
-    }
-    return numstack[--nnumstack];
 }
 
+void ExpressionEvaluator::push_op(operator_type *op)
+{
+    aux[nopstack] = (op->op == '(') ? 0 : -1;
+    opstack[nopstack++] = op;
+}
+
+void ExpressionEvaluator::push_operand(uint8_t kind, int value, int start)
+{
+    operands[noperands].kind = kind;
+    operands[noperands].value = value;
+    operands[noperands].start = start;
+    noperands++;
+}
+
+/* The operand on top of the stack was computed into its register */
+void ExpressionEvaluator::push_result(int start)
+{
+    push_operand(OPERAND_REG, noperands, start);
+}
+
+void ExpressionEvaluator::emit(uint8_t b)
+{
+    if(code && EXPR_HEADER_SIZE + codeLen < EXPR_MAX_CODE)
+        code[EXPR_HEADER_SIZE + codeLen] = b;
+    codeLen++;
+}
 
-void ExpressionEvaluator::shunt_op(operator_type *op)
+void ExpressionEvaluator::emit_op(uint8_t op, int dst)
 {
-    operator_type *pop;
-    int n1, n2;
+    emit(op);
+    emit(dst);
+    if(dst >= maxRegs)
+        maxRegs = dst + 1;
+}
 
-    if(op->op == '(') {
-        push_opstack(op);
+void ExpressionEvaluator::emit_arg(const operand_info &arg)
+{
+    if(arg.kind == OPERAND_REG) {
+        emit(arg.value);
         return;
+    }
+    emit(arg.kind == OPERAND_CONST ? EXPR_ARG_CONST : EXPR_ARG_TOKEN);
+    emit(arg.value & 0xFF);
+    emit((arg.value >> 8) & 0xFF);
+}
 
-    } else if(op->op == ')') {
-        while(nopstack > 0 && opstack[nopstack-1]->op != '(') {
-            pop = pop_opstack();
-            n1 = pop_numstack();
+/* Called when a binary operator is pushed: its left operand is complete */
+void ExpressionEvaluator::begin_op(operator_type *op)
+{
+    operand_info &a = operands[noperands-1];
 
-            if(pop->unary)
-                push_numstack(pop->eval(n1, 0));
-            else {
-                n2=pop_numstack();
-                push_numstack(pop->eval(n2, n1));
-            }
-        }
+    if(!is_logical(op, flags) || a.kind == OPERAND_CONST)
+        return;
 
-        if(!(pop = pop_opstack()) || pop->op != '(') {
-//            Serial.println("ERROR: Stack error. No matching \'(\'");
-            return;
+    emit_op(op->op == '&' ? EXPR_OP_JFALSE : EXPR_OP_JTRUE, noperands-1);
+    emit_arg(a);
+    aux[nopstack-1] = codeLen;
+    emit(0);
+}
+
+bool ExpressionEvaluator::apply_op(operator_type *op, int jump)
+{
+    int argc = op->unary ? 1 : 2;
+    if(noperands < argc) {
+        Serial.println("ERROR: Missing operand");
+        return false;
+    }
+
+    noperands -= argc;
+    int dst = noperands;
+    operand_info a = operands[dst];
+    operand_info b = operands[dst + argc - 1];
+
+    if(op->unary) {
+        if(a.kind == OPERAND_CONST) {
+            push_operand(OPERAND_CONST, op->eval(a.value, 0), a.start);
+        } else {
+            emit_op(op - operators, dst);
+            emit_arg(a);
+            push_result(a.start);
         }
-        return;
+        return true;
     }
 
-    if(op->assoc == ASSOC_RIGHT) {
-        while(nopstack && op->prec<opstack[nopstack-1]->prec) {
-            pop = pop_opstack();
-            n1 = pop_numstack();
-            if(pop->unary)
-                push_numstack(pop->eval(n1, 0));
-            else {
-                n2 = pop_numstack();
-                push_numstack(pop->eval(n2, n1));
-            }
+    bool logical = is_logical(op, flags);
+
+    if(a.kind == OPERAND_CONST && b.kind == OPERAND_CONST) {
+        int v;
+        if(logical)
+            v = (op->op == '&') ? (a.value && b.value) : (a.value || b.value);
+        else
+            v = op->eval(a.value, b.value);
+        push_operand(OPERAND_CONST, v, a.start);
+
+    } else if(logical && a.kind == OPERAND_CONST) {
+        /* No jump was emitted for a literal left operand */
+        if((op->op == '&') ? !a.value : a.value) {
+            codeLen = a.start;
+            push_operand(OPERAND_CONST, op->op == '|', a.start);
+        } else {
+            emit_op(EXPR_OP_BOOL, dst);
+            emit_arg(b);
+            push_result(a.start);
         }
+
+    } else if(logical && b.kind == OPERAND_CONST && ((op->op == '&') ? !b.value : b.value)) {
+        /* Reading the left operand has no side effects */
+        codeLen = a.start;
+        push_operand(OPERAND_CONST, op->op == '|', a.start);
+
     } else {
-        while(nopstack && op->prec<=opstack[nopstack-1]->prec) {
-            pop = pop_opstack();
-            n1 = pop_numstack();
-            if(pop->unary)
-                push_numstack(pop->eval(n1, 0));
-            else {
-                n2 = pop_numstack();
-                push_numstack(pop->eval(n2, n1));
-            }
+        if(jump >= 0) {
+            emit_op(EXPR_OP_BOOL, dst);
+            emit_arg(b);
+            if(code && EXPR_HEADER_SIZE + codeLen <= EXPR_MAX_CODE)
+                code[EXPR_HEADER_SIZE + jump] = codeLen - jump - 1;
+        } else {
+            emit_op(op - operators, dst);
+            emit_arg(a);
+            emit_arg(b);
         }
+        push_result(a.start);
     }
-    push_opstack(op);
+    return true;
 }
 
-int ExpressionEvaluator::istoken_char(char c) {
-    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || isdigit(c) || (c == '_'))
-        return 1;
-    else
-        return 0;
+bool ExpressionEvaluator::shunt_op(operator_type *op)
+{
+    while(nopstack && op->prec <= opstack[nopstack-1]->prec) {
+        --nopstack;
+        if(!apply_op(opstack[nopstack], aux[nopstack]))
+            return false;
+    }
+    push_op(op);
+    begin_op(op);
+    return true;
 }
 
-int ExpressionEvaluator::eval(const char *expression)
+/* Handles ')' and the ',' between function arguments */
+bool ExpressionEvaluator::close_paren(bool comma)
+{
+    while(nopstack && opstack[nopstack-1]->op != '(') {
+        --nopstack;
+        if(!apply_op(opstack[nopstack], aux[nopstack]))
+            return false;
+    }
+
+    if(!nopstack) {
+        Serial.println("ERROR: Stack error. No matching \'(\'");
+        return false;
+    }
+
+    int paren = nopstack - 1;
+    bool function = paren > 0 && is_function(opstack[paren-1]);
+
+    if(comma) {
+        if(!function || aux[paren]) {
+            Serial.println("ERROR: Unexpected \',\'");
+            return false;
+        }
+        aux[paren]++;
+        return true;
+    }
+
+    if(aux[paren] != (function ? 1 : 0)) {
+        Serial.println("ERROR: Function takes two arguments");
+        return false;
+    }
+
+    nopstack = paren;
+    if(function) {
+        --nopstack;
+        return apply_op(opstack[nopstack], -1);
+    }
+    return true;
+}
+
+bool ExpressionEvaluator::push_token(char *tstart, int len)
+{
+    if(isdigit(tstart[0])) {
+        for(int i = 1; i < len; i++) {
+            if(!isdigit(tstart[i])) {
+                Serial.println("ERROR: Syntax error");
+                return false;
+            }
+        }
+        push_operand(OPERAND_CONST, atoi(tstart), codeLen);
+        return true;
+    }
+
+    if(!resolver) {
+        push_operand(OPERAND_CONST, (*tokenEvaluator)(tstart), codeLen);
+        return true;
+    }
+
+    if(len > EXPR_MAX_TOKEN - 1) {
+        Serial.println("ERROR: Token too long");
+        return false;
+    }
+
+    char token[EXPR_MAX_TOKEN];
+    memcpy(token, tstart, len);
+    token[len] = 0;
+
+    int value = (*resolver)(token);
+    if(value == EVAL_FAILURE) {
+        Serial.print("ERROR: Unknown token "); Serial.println(token);
+        return false;
+    }
+
+    push_operand(OPERAND_TOKEN, value, codeLen);
+    return true;
+}
+
+bool ExpressionEvaluator::parse(const char *expression, int *result)
 {
+    /* There are never more operators or operands than characters */
+    int len = strlen(expression) + 1;
+    operator_type *opBuffer[len];
+    int auxBuffer[len];
+    operand_info operandBuffer[len];
+
+    opstack = opBuffer;
+    aux = auxBuffer;
+    operands = operandBuffer;
     nopstack = 0;
-    nnumstack = 0;
-
-    char *tstart = 0;
-    operator_type startop = {'X', ASSOC_NONE, 0, 0};  /* Dummy operator to mark start */
-    operator_type *op = 0;
-    int n1, n2;
-    operator_type *lastop = &startop;
-
-    for (char *expr = (char*)expression; *expr; ++expr) {
-        if (!tstart) {
-
-            if ((op = getop(*expr))) {
-                if (lastop && (lastop == &startop || lastop->op != ')')) {
-                    if ((op->op != '(') && !op->unary) {
-                       Serial.print("ERROR: Illegal use of binary operator "); Serial.println(op->op);
-                        return EVAL_FAILURE;
-                    }
+    noperands = 0;
+
+    bool expectOperand = true;
+    const char *p = expression;
+    operator_type *op;
+
+    while(*p) {
+        if(isspace(*p)) {
+            ++p;
+            continue;
+        }
+
+        if(expectOperand) {
+            if(istoken_char(*p)) {
+                const char *tstart = p;
+                while(istoken_char(*p))
+                    ++p;
+
+                const char *next = p;
+                while(isspace(*next))
+                    ++next;
+                if(*next == '(' && (op = getfunction(tstart, p - tstart))) {
+                    push_op(op);
+                    push_op(getop('('));
+                    p = next + 1;
+                    continue;
                 }
 
-                shunt_op(op);
-                lastop = op;
-            } else if (istoken_char(*expr))
-                tstart = expr;
-            else if (!isspace(*expr)) {
-               Serial.println("ERROR: Syntax error");
-                return EVAL_FAILURE;
+                if(!push_token((char*)tstart, p - tstart))
+                    return false;
+                expectOperand = false;
+                continue;
+            }
+
+            if(*p == '(')
+                op = getop('(');
+            else if(*p == '!')
+                op = getop('!');
+            else if(*p == '-')
+                op = getop('~');
+            else {
+                Serial.println("ERROR: Syntax error");
+                return false;
             }
+            push_op(op);
+            ++p;
+
+        } else if(*p == ')' || *p == ',') {
+            if(!close_paren(*p == ','))
+                return false;
+            expectOperand = (*p == ',');
+            ++p;
+
         } else {
-            if (isspace(*expr)) {
-                push_numstack((*tokenEvaluator)(tstart));
-                tstart = 0;
-                lastop = 0;
-            } else if ((op=getop(*expr))) {
-                push_numstack((*tokenEvaluator)(tstart));
-                tstart = 0;
-                shunt_op(op);
-                lastop = op;
-            } else if (!istoken_char(*expr) ) {
-               Serial.println("ERROR: Syntax error");
-                return EVAL_FAILURE;
+            if(!(op = getbinop(p))) {
+                Serial.println("ERROR: Syntax error");
+                return false;
             }
+            if(!shunt_op(op))
+                return false;
+            expectOperand = true;
         }
     }
-    if(tstart)
-        push_numstack((*tokenEvaluator)(tstart));
+
+    if(expectOperand) {
+        Serial.println("ERROR: Unexpected end of expression");
+        return false;
+    }
 
     while(nopstack) {
-        op = pop_opstack();
-        n1 = pop_numstack();
-        if(op->unary)
-            push_numstack(op->eval(n1, 0));
-        else {
-            n2 = pop_numstack();
-            push_numstack(op->eval(n2, n1));
+        --nopstack;
+        if(opstack[nopstack]->op == '(') {
+            Serial.println("ERROR: Stack error. No matching \')\'");
+            return false;
         }
+        if(!apply_op(opstack[nopstack], aux[nopstack]))
+            return false;
+    }
+
+    if(noperands != 1) {
+        Serial.print("ERROR: Number stack has "); Serial.print(noperands); Serial.println(" elements after evaluation. Should be 1.");
+        return false;
+    }
+
+    /* The result goes to register 0 */
+    if(operands[0].kind != OPERAND_REG) {
+        emit_op(EXPR_OP_MOV, 0);
+        emit_arg(operands[0]);
     }
 
-    if(nnumstack != 1) {
-       Serial.print("ERROR: Number stack has "); Serial.print(nnumstack); Serial.println(" elements after evaluation. Should be 1.");
+    *result = operands[0].value;
+    return true;
+}
+
+int ExpressionEvaluator::eval(const char *expression)
+{
+    int result;
+
+    resolver = NULL;
+    flags = 0;
+    code = NULL;
+    codeLen = 0;
+    maxRegs = 0;
+
+    /* Every token is a literal here, so the whole expression folds */
+    if(!parse(expression, &result))
         return EVAL_FAILURE;
+    return result;
+}
+
+int ExpressionEvaluator::compile(const char *expression, uint8_t *code, int size, TokenResolver *resolver, uint8_t flags)
+{
+    uint8_t buffer[EXPR_MAX_CODE];
+    int result;
+
+    this->resolver = resolver;
+    this->flags = flags;
+    this->code = buffer;
+    codeLen = 0;
+    maxRegs = 0;
+
+    bool ok = parse(expression, &result);
+
+    this->resolver = NULL;
+    this->code = NULL;
+
+    if(!ok)
+        return EVAL_FAILURE;
+
+    int total = EXPR_HEADER_SIZE + codeLen;
+    if(total > EXPR_MAX_CODE || maxRegs > EXPR_MAX_REGS || (code && total > size)) {
+        Serial.println("ERROR: Expression too complex");
+        return EVAL_FAILURE;
+    }
+
+    if(code) {
+        buffer[0] = codeLen;
+        buffer[1] = maxRegs;
+        memcpy(code, buffer, total);
+    }
+    return total;
+}
+
+static inline int fetch(const uint8_t *&pc, const int *regs, HandleEvaluator *ev)
+{
+    uint8_t arg = *pc++;
+    if(arg < EXPR_ARG_CONST)
+        return regs[arg];
+
+    int value = pc[0] | (pc[1] << 8);
+    pc += 2;
+    if(arg == EXPR_ARG_CONST)
+        return (int16_t)value;
+    return (*ev)(value);
+}
+
+int ExpressionEvaluator::run(const uint8_t *code, HandleEvaluator *ev)
+{
+    int regs[code[1]];
+
+    const uint8_t *pc = code + EXPR_HEADER_SIZE;
+    const uint8_t *end = pc + code[0];
+
+    while(pc < end) {
+        uint8_t op = *pc++;
+        uint8_t dst = *pc++;
+        int a = fetch(pc, regs, ev);
+
+        switch(op) {
+        case EXPR_OP_MOV:
+            regs[dst] = a;
+            break;
+        case EXPR_OP_BOOL:
+            regs[dst] = a != 0;
+            break;
+        case EXPR_OP_JFALSE: {
+            uint8_t offset = *pc++;
+            if(!a) {
+                regs[dst] = 0;
+                pc += offset;
+            }
+            break;
+        }
+        case EXPR_OP_JTRUE: {
+            uint8_t offset = *pc++;
+            if(a) {
+                regs[dst] = 1;
+                pc += offset;
+            }
+            break;
+        }
+        default:
+            if(operators[op].unary)
+                regs[dst] = operators[op].eval(a, 0);
+            else
+                regs[dst] = operators[op].eval(a, fetch(pc, regs, ev));
+        }
+    }
+
+    return regs[0];
+}
+
+int ExpressionEvaluator::handles(const uint8_t *code, uint16_t *handles, int size)
+{
+    int n = 0;
+
+    const uint8_t *pc = code + EXPR_HEADER_SIZE;
+    const uint8_t *end = pc + code[0];
+
+    while(pc < end) {
+        uint8_t op = *pc++;
+        pc++;  /* destination */
+
+        int argc = (op >= EXPR_OP_MOV || operators[op].unary) ? 1 : 2;
+        for(int i = 0; i < argc; i++) {
+            uint8_t arg = *pc++;
+            if(arg < EXPR_ARG_CONST)
+                continue;
+
+            uint16_t value = pc[0] | (pc[1] << 8);
+            pc += 2;
+            if(arg != EXPR_ARG_TOKEN)
+                continue;
+
+            int j = 0;
+            while(j < n && handles[j] != value)
+                j++;
+            if(j == n && n < size)
+                handles[n++] = value;
+        }
+
+        if(op == EXPR_OP_JFALSE || op == EXPR_OP_JTRUE)
+            pc++;
     }
 
-    return numstack[0];
+    return n;
 }
@@ -1,11 +1,42 @@
 #ifndef EXPRESSIONEVALUATOR_H
 #define EXPRESSIONEVALUATOR_H
 
-#define MAXOPSTACK 64
-#define MAXNUMSTACK 64
+#include <inttypes.h>
 
 #define EVAL_FAILURE -1
 
+// Longest token passed to a TokenResolver, including the terminating zero
+#define EXPR_MAX_TOKEN 24
+
+// Most registers a compiled expression may use
+#define EXPR_MAX_REGS 16
+
+// Largest compiled expression, including the header
+#define EXPR_MAX_CODE 0xFF
+
+// compile() flags
+// In short-circuit mode '&' and '|' are logical operators: the right
+// operand is skipped as soon as the left one decides the result.
+#define EXPR_SHORT_CIRCUIT 0x01
+
+// Bytecode produced by ExpressionEvaluator::compile()
+//
+// A program starts with a two byte header: the size of the code that follows
+// and the number of registers it needs. Every instruction is an opcode, a
+// destination register and its arguments; the result is left in register 0.
+// Operator opcodes are the operator indexes and take one or two arguments.
+// An argument is a register number, or EXPR_ARG_CONST / EXPR_ARG_TOKEN
+// followed by a 16 bit little endian literal or token handle. Jumps take one
+// argument followed by a forward offset counted from the next opcode.
+// Operations on literals are folded while compiling.
+#define EXPR_HEADER_SIZE 2
+#define EXPR_OP_MOV 0x80     // dst = arg
+#define EXPR_OP_BOOL 0x81    // dst = arg != 0
+#define EXPR_OP_JFALSE 0x82  // if arg is 0 set dst to 0 and jump
+#define EXPR_OP_JTRUE 0x83   // if arg is not 0 set dst to 1 and jump
+#define EXPR_ARG_CONST 0x80
+#define EXPR_ARG_TOKEN 0x81
+
 class TokenEvaluator{
 public:
     virtual int operator()( char *expr )=0;
@@ -41,6 +72,42 @@ public:
 
 };
 
+// Maps a token to a handle when compiling; returns EVAL_FAILURE for unknown tokens
+class TokenResolver{
+public:
+    virtual int operator()( char *token )=0;
+};
+
+template<typename F>
+class GenericTokenResolver : public TokenResolver
+{
+    F* f;
+public:
+    GenericTokenResolver(F _f): f(_f) {}
+    int operator()( char *token )
+    {
+        return f(token);
+    }
+};
+
+// Returns the value of a resolved token when running compiled code
+class HandleEvaluator{
+public:
+    virtual int operator()( uint16_t handle )=0;
+};
+
+template<typename F>
+class GenericHandleEvaluator : public HandleEvaluator
+{
+    F* f;
+public:
+    GenericHandleEvaluator(F _f): f(_f) {}
+    int operator()( uint16_t handle )
+    {
+        return f(handle);
+    }
+};
+
 struct operator_type {
   char op;
   int prec;
@@ -49,6 +116,9 @@ struct operator_type {
   int (*eval)(int a1, int a2);
 };
 
+// Expressions are integer arithmetic (+ - * / %, unary -), comparisons
+// (= == != > < >= <=), logic (& | !), parentheses and the functions
+// min(a, b) and max(a, b). Division by zero yields 0.
 class ExpressionEvaluator
 {
 public:
@@ -56,22 +126,57 @@ public:
     int eval(const char *expression);
     static int istoken_char(char c);
 
-private:
+    // Compiles the expression into code of at most size bytes.
+    // Returns the size of the program or EVAL_FAILURE. With code set to 0
+    // only the size is computed.
+    int compile(const char *expression, uint8_t *code, int size, TokenResolver *resolver, uint8_t flags = 0);
 
-    operator_type *opstack[MAXOPSTACK];
-    int numstack[MAXNUMSTACK];
+    // Runs a program returned by compile()
+    static int run(const uint8_t *code, HandleEvaluator *ev);
 
-    int nopstack;
-    int nnumstack;
+    // Stores the distinct token handles a program reads, at most size of
+    // them, and returns their number
+    static int handles(const uint8_t *code, uint16_t *handles, int size);
+
+private:
 
     TokenEvaluator *tokenEvaluator;
 
-    operator_type *getop(char ch);
-    void push_opstack(operator_type *op);
-    operator_type *pop_opstack();
-    void push_numstack(int num);
-    int pop_numstack();
-    void shunt_op(operator_type *op);
+    // Parser state. The stacks are sized from the expression length by
+    // parse(); an operand that is not a literal or a token lives in the
+    // register numbered after its stack position.
+    enum { OPERAND_CONST, OPERAND_TOKEN, OPERAND_REG };
+    struct operand_info {
+        uint8_t kind;
+        int value;      // literal, token handle or register
+        int start;      // offset of the code computing the operand
+    };
+
+    operator_type **opstack;
+    int *aux;                // parallel to opstack: jump to patch or -1, comma count for '('
+    operand_info *operands;
+    int nopstack;
+    int noperands;
+
+    // compile() state, resolver is 0 while evaluating
+    TokenResolver *resolver;
+    uint8_t flags;
+    uint8_t *code;
+    int codeLen;
+    int maxRegs;
+
+    void push_op(operator_type *op);
+    bool shunt_op(operator_type *op);
+    bool close_paren(bool comma);
+    bool apply_op(operator_type *op, int aux);
+    void begin_op(operator_type *op);
+    void push_operand(uint8_t kind, int value, int start);
+    void push_result(int start);
+    bool push_token(char *tstart, int len);
+    void emit(uint8_t b);
+    void emit_op(uint8_t op, int dst);
+    void emit_arg(const operand_info &arg);
+    bool parse(const char *expression, int *result);
 };
 
 #endif // EXPRESSIONEVALUATOR_H
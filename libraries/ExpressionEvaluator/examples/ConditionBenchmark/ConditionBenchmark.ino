@@ -0,0 +1,108 @@
+/**
+ * Benchmark of condition evaluation.
+ *
+ * Conditions of 1, 5 and 20 terms joined with '&' are evaluated 1000 times
+ * each: from text with eval(), as compiled code, and as compiled code in
+ * short-circuit mode. Every condition is run once with all terms true (the
+ * whole chain has to be evaluated) and once with the first term false.
+ *
+ * A brightness style condition mixing arithmetic, ranges and min/max is
+ * measured the same way.
+ *
+ * Results are printed in microseconds per evaluation.
+ */
+
+#include <ExpressionEvaluator.h>
+
+#define ITERATIONS 1000
+#define MAX_TERMS 20
+
+int values[MAX_TERMS];
+
+// Tokens are T0..T19, the handle is the term number
+int evalToken(char *token) {
+  return values[atoi(token + 1)];
+}
+
+int resolveToken(char *token) {
+  if (token[0] != 'T')
+    return EVAL_FAILURE;
+  return atoi(token + 1);
+}
+
+int evalHandle(uint16_t handle) {
+  return values[handle];
+}
+
+GenericTokenEvaluator<int(char*)> tokenEvaluator(&evalToken);
+GenericTokenResolver<int(char*)> tokenResolver(&resolveToken);
+GenericHandleEvaluator<int(uint16_t)> handleEvaluator(&evalHandle);
+ExpressionEvaluator evaluator(&tokenEvaluator);
+
+char condition[MAX_TERMS * 4];
+uint8_t code[EXPR_MAX_CODE];
+uint8_t shortCode[EXPR_MAX_CODE];
+
+void buildCondition(int terms) {
+  condition[0] = 0;
+  for (int i = 0; i < terms; i++) {
+    char term[5];
+    sprintf(term, i ? "&T%d" : "T%d", i);
+    strcat(condition, term);
+  }
+}
+
+float measureEval() {
+  unsigned long t = micros();
+  for (int i = 0; i < ITERATIONS; i++)
+    evaluator.eval(condition);
+  return (float)(micros() - t) / ITERATIONS;
+}
+
+float measureRun(const uint8_t *program) {
+  unsigned long t = micros();
+  for (int i = 0; i < ITERATIONS; i++)
+    ExpressionEvaluator::run(program, &handleEvaluator);
+  return (float)(micros() - t) / ITERATIONS;
+}
+
+void benchmark(int terms, bool firstFalse) {
+  for (int i = 0; i < MAX_TERMS; i++)
+    values[i] = 1;
+  if (firstFalse)
+    values[0] = 0;
+
+  Serial.print(terms);
+  Serial.print(firstFalse ? " terms, first false: " : " terms, all true:    ");
+  Serial.print("eval=");
+  Serial.print(measureEval());
+  Serial.print(" run=");
+  Serial.print(measureRun(code));
+  Serial.print(" short-circuit=");
+  Serial.println(measureRun(shortCode));
+}
+
+void setup() {
+  Serial.begin(115200);
+
+  int terms[] = { 1, 5, MAX_TERMS };
+  for (int i = 0; i < 3; i++) {
+    buildCondition(terms[i]);
+    evaluator.compile(condition, code, sizeof(code), &tokenResolver);
+    evaluator.compile(condition, shortCode, sizeof(shortCode), &tokenResolver, EXPR_SHORT_CIRCUIT);
+
+    benchmark(terms[i], false);
+    benchmark(terms[i], true);
+  }
+
+  strcpy(condition, "T0 & T1 >= 1 & T1 <= max(T2, 20) * 2 + T3 % 8");
+  evaluator.compile(condition, code, sizeof(code), &tokenResolver);
+  evaluator.compile(condition, shortCode, sizeof(shortCode), &tokenResolver, EXPR_SHORT_CIRCUIT);
+  Serial.print("Ranges and arithmetic, ");
+  benchmark(4, false);
+  Serial.print("Ranges and arithmetic, ");
+  benchmark(4, true);
+}
+
+void loop() {
+}
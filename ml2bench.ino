@@ -0,0 +1,76 @@
+#ifdef BENCHMARK_RULES
+
+// Measures button event dispatch through the rule table with a synthetic
+// configuration: every rule toggles two outputs on a click of one input,
+// every third one only if a third output is on.
+//
+// The sizes keep three rules per input and fit the Mega's RAM next to the
+// rest of the sketch, the table is built before the configuration is
+// loaded. Turn off DEBUG_RULES, it prints every applied action.
+#define BENCHMARK_INPUTS      16
+#define BENCHMARK_OUTPUTS     8
+#define BENCHMARK_RULE_COUNT  48
+#define BENCHMARK_EVENTS      10000L
+
+void addBenchmarkRules(bool add) {
+  char id[ID_SIZE];
+  for (int r = 0; r < BENCHMARK_RULE_COUNT; r++) {
+    ML2Rule rule("");
+
+    sprintf(id, "BI%d", r % BENCHMARK_INPUTS);
+    rule.addInput(id);
+    sprintf(id, "BO%d", r % BENCHMARK_OUTPUTS);
+    rule.addOutput(id);
+    sprintf(id, "BO%d", (r + 1) % BENCHMARK_OUTPUTS);
+    rule.addOutput(id);
+
+    rule.setAction(ButtonEvent::Click, OutputAction::Toggle);
+    if (r % 3 == 0) {
+      sprintf(id, "RBO%d", (r + 2) % BENCHMARK_OUTPUTS);
+      rule.setCondition(ButtonEvent::Click, id);
+    }
+
+    add ? ruleTable.add(&rule) : ruleTable.count(&rule);
+  }
+}
+
+// Runs before the configuration is loaded and leaves the lists empty
+void benchmarkRules() {
+  char id[ID_SIZE];
+  for (int i = 0; i < BENCHMARK_INPUTS; i++) {
+    sprintf(id, "BI%d", i);
+    ML2Input *input = new ML2Input(id);
+    input->index = i;
+    inputList.addInput(input);
+  }
+  for (int i = 0; i < BENCHMARK_OUTPUTS; i++) {
+    sprintf(id, "BO%d", i);
+    ML2Output *output = new ML2Output(id);
+    output->index = i;
+    output->setNoreport(true);
+    outputList.addOutput(output);
+  }
+
+  ruleTable.begin();
+  addBenchmarkRules(false);
+  if (ruleTable.allocate()) {
+    addBenchmarkRules(true);
+    ruleTable.end();
+
+    uint32_t start = micros();
+    for (long e = 0; e < BENCHMARK_EVENTS; e++)
+      ruleTable.processButtonEvent(ButtonEvent::Click, inputList.at(e % BENCHMARK_INPUTS));
+    uint32_t time = micros() - start;
+
+    Serialprint("Rule table: %d inputs, %d rules, %lu events/s\r\n", BENCHMARK_INPUTS, BENCHMARK_RULE_COUNT,
+                (unsigned long)(BENCHMARK_EVENTS * 1000000.0 / (time ? time : 1)));
+  } else {
+    Serialprint("Not enough memory for %d benchmark rules\r\n", BENCHMARK_RULE_COUNT);
+  }
+
+  ruleTable.clear();
+  inputList.clearInputs();
+  outputList.clearOutputs();
+}
+
+#endif
@@ -9,16 +9,182 @@
 
 #define ID_SIZE 13
 #define PWM_HIGH 255
+#define OUTPUT_CHANNEL_SIZE 32     // deferred group actions queue one command per output
+#define INPUT_CHANNEL_SIZE 32      // button events emitted by one pass over the inputs
 
 uint32_t parseTime(const char* v);
-
-class OutputEventParam : public EventParam
+int compileRuleExpr(const String &expr, byte *code, int size);
+bool runRuleExpr(const byte *code);
+// Lists the outputs a compiled condition reads, returns their number or -1
+// if there are more than size
+int ruleExprOutputs(const byte *code, byte *outputs, int size);
+
+namespace ChannelMerge {
+enum Result {
+    Unrelated,  // keep looking at older commands
+    Merged,     // the queued command now stands for both
+    Blocked     // the new command has to be queued on its own
+};
+}
+
+// Queue of N commands of type T held by value and dispatched to a listener
+// fixed at compile time, so sending and processing a command needs no heap,
+// virtual call or cast. With merging on, a new command is offered to the
+// pending ones, newest first, through T::merge(queued, cmd). Not interrupt
+// safe. N must be a power of two <= 128.
+template<class T, byte N, void (*Listener)(const T &)>
+class Channel
 {
   public:
-    OutputEventParam(void *sender, int param, uint32_t timeout = 0) : EventParam(sender, param), timeout(timeout) {}
-    uint32_t timeout;
+    Channel() : m_head(0), m_count(0), m_merge(false) {
+      resetStats();
+    }
+
+    inline void setMerge(bool merge) {
+      m_merge = merge;
+    }
+    inline bool isEmpty() {
+      return !m_count;
+    }
+
+    // Returns false if the channel is full and the command was dropped
+    bool send(const T &cmd) {
+      if (m_merge && merge(cmd))
+        return true;
+
+      if (m_count == N) {
+        m_dropped++;
+        return false;
+      }
+
+      Slot &slot = m_slots[(m_head + m_count) & (N - 1)];
+      slot.cmd = cmd;
+      slot.time = millis();
+      if (++m_count > m_highWater)
+        m_highWater = m_count;
+      m_enqueued++;
+      return true;
+    }
+
+    // Dispatches pending commands, including ones sent meanwhile, returns their number
+    byte process() {
+      byte n = 0;
+      while (m_count) {
+        Slot slot = m_slots[m_head];
+        m_head = (m_head + 1) & (N - 1);
+        m_count--;
+
+        unsigned int dwell = (unsigned int)millis() - slot.time;
+        if (dwell > m_maxDwell)
+          m_maxDwell = dwell;
+        m_totalDwell += dwell;
+        m_dispatched++;
+
+        Listener(slot.cmd);
+        n++;
+      }
+      return n;
+    }
+
+    void getStats(EventManager::QueueStats *stats) {
+      stats->size = N;
+      stats->timerSize = 0;
+      stats->depth = m_count;
+      stats->highWater = m_highWater;
+      stats->enqueued = m_enqueued;
+      stats->dropped = m_dropped;
+      stats->coalesced = m_merged;
+      stats->dispatched = m_dispatched;
+      stats->maxDwell = m_maxDwell;
+      stats->totalDwell = m_totalDwell;
+    }
+
+    void resetStats() {
+      m_highWater = m_count;
+      m_enqueued = 0;
+      m_dropped = 0;
+      m_merged = 0;
+      m_dispatched = 0;
+      m_maxDwell = 0;
+      m_totalDwell = 0;
+    }
+
+  private:
+    struct Slot {
+      T cmd;
+      unsigned int time;    // low bits of millis() when sent
+    };
+
+    Slot m_slots[N];
+    byte m_head;
+    byte m_count;
+    bool m_merge;
+
+    byte m_highWater;
+    unsigned long m_enqueued;
+    unsigned int m_dropped;
+    unsigned int m_merged;
+    unsigned long m_dispatched;
+    unsigned int m_maxDwell;
+    unsigned long m_totalDwell;
+
+    bool merge(const T &cmd) {
+      for (byte n = m_count; n > 0; n--) {
+        ChannelMerge::Result result = T::merge(m_slots[(m_head + n - 1) & (N - 1)].cmd, cmd);
+        if (result == ChannelMerge::Merged) {
+          m_merged++;
+          return true;
+        }
+        if (result == ChannelMerge::Blocked)
+          break;
+      }
+      return false;
+    }
+};
+
+// An action for the output at position output in outputList
+struct OutputCommand
+{
+  OutputCommand() {}
+  OutputCommand(byte output, byte action, int param, uint32_t timeout = 0)
+    : output(output), action(action), param(param), timeout(timeout) {}
+
+  byte output;
+  byte action;              // OutputAction::Action
+  int param;
+  uint32_t timeout;
+
+  // Keeps at most one pending value command (Value, IncValue) and one
+  // pending state command (On, Off, Toggle) per output. Repeated increments
+  // are summed and later absolute actions replace earlier ones.
+  static ChannelMerge::Result merge(OutputCommand &queued, const OutputCommand &cmd);
+};
+
+void outputCommandListener(const OutputCommand &cmd);
+// Queues cmd into outputChannel, reporting it if the channel is full
+bool sendOutputCommand(const OutputCommand &cmd);
+
+typedef Channel<OutputCommand, OUTPUT_CHANNEL_SIZE, outputCommandListener> OutputChannel;
+
+// A button event of the input at position input in inputList
+struct InputEvent
+{
+  InputEvent() {}
+  InputEvent(byte input, byte event) : input(input), event(event) {}
+
+  byte input;
+  byte event;               // ButtonEvent::Type
+
+  // every press counts, so button events are never merged
+  static inline ChannelMerge::Result merge(InputEvent &queued, const InputEvent &event) {
+    return ChannelMerge::Blocked;
+  }
 };
 
+void inputEventListener(const InputEvent &event);
+
+typedef Channel<InputEvent, INPUT_CHANNEL_SIZE, inputEventListener> InputChannel;
+
 class ML2Output;
 
 class OutputList : public SimpleList<ML2Output *>
@@ -43,6 +209,7 @@ class ML2Output
 
     char ID[ID_SIZE];
     int storeAddress;
+    byte index;             // position in outputList, set by setupOutputs()
 
     inline byte pin() {
       return m_pin;
@@ -74,6 +241,7 @@ class ML2Output
     bool toggle(uint32_t timeout = 0);
     void setValue(byte value, uint32_t timeout = 0);
     void incValue(int val, uint32_t timeout = 0);
+    void setState(bool on, byte value, uint32_t timeout = 0);
 
     uint32_t timeout();
     bool invert();
@@ -85,8 +253,18 @@ class ML2Output
 
     void setSaveState(OutputStateSave::Save saveState);
 
+    // State changes between beginBatch() and endBatch() are not reported,
+    // the caller reports them at once
+    static inline void beginBatch() {
+      s_batch++;
+    }
+    static inline void endBatch() {
+      s_batch--;
+    }
 
   protected:
+    static byte s_batch;
+
     byte m_pin;
     bool m_pwm;
     byte m_value;
@@ -105,6 +283,77 @@ class ML2Output
 
 };
 
+#define GROUPS_PATH "/GROUPS"
+
+class ML2Group
+{
+  public:
+    ML2Group(const String &id);
+
+    char ID[ID_SIZE];
+
+    inline OutputList *outputs() {
+      return &outputlist;
+    }
+
+    // Applies the action to all outputs and reports them at once
+    void action(OutputAction::Action action, int param = 0, uint32_t timeout = 0);
+    void emitState();
+
+  private:
+    OutputList outputlist;
+};
+
+class GroupList : public SimpleList<ML2Group *>
+{
+  public:
+    GroupList();
+
+    bool addGroup(ML2Group *group);
+    ML2Group *find(const char *id);
+
+    void clearGroups();
+};
+
+class ML2Scene
+{
+  public:
+    ML2Scene(const String &id, ML2Group *group);
+    ~ML2Scene();
+
+    char ID[ID_SIZE];
+    ML2Group *group;
+
+    // Takes one of "on", "off" or a value (on with that value) per output of the group
+    bool setStates(const char *states);
+    void apply();
+
+    inline byte *data() {
+      return m_data;
+    }
+    inline int dataSize() {
+      return m_size;
+    }
+
+  private:
+    // on mask, value mask, then one value per output
+    byte *m_data;
+    int m_size;
+};
+
+class SceneList : public SimpleList<ML2Scene *>
+{
+  public:
+    SceneList();
+
+    bool addScene(ML2Scene *scene);
+    ML2Scene *find(const char *id);
+    // Deletes the scenes of a group that is dropped
+    void removeScenes(ML2Group *group);
+
+    void clearScenes();
+};
+
 #define DOUBLE_CLICK_INTERVAL 400
 #define HOLD_INTERVAL 500
 #define REPEAT_INTERVAL 250
@@ -126,12 +375,25 @@ class InputList : public SimpleList<ML2Input *>
     bool removeInput(ML2Input *input);
     bool hasInput(ML2Input *input);
     ML2Input *find(const char *id);
-    bool addInputRule(const char *inputId, int addrRule);
+
+    // Sets up the active set once the inputs are attached to inputCapture
+    // and portScanner. Returns false if out of memory, then check() runs
+    // every input on every pass.
+    bool setupActive();
 
     void check();
     void clearInputs();
 
   private:
+    // Only inputs that are settling or in the middle of a gesture
+    // need timed processing. Idle ones join the active set when an edge is
+    // captured or their debounced port bit changes.
+    byte *m_active;             // positions of the active inputs
+    byte m_cntActive;
+    byte *m_isActive;           // bit set of the active positions
+    byte m_portInputs[PORTSCANNER_MAX_PORTS][8];  // position of the input on each port pin, 0xFF if none
+
+    void activate(byte index);
 };
 
 class ML2Input : public Bounce
@@ -140,7 +402,7 @@ class ML2Input : public Bounce
     ML2Input(const String &id);
 
     char ID[ID_SIZE];
-    SimpleList<int> rules;
+    byte index;             // position in inputList, set by setupInputCapture()
 
     inline byte pin() {
       return m_pin;
@@ -179,7 +441,34 @@ class ML2Input : public Bounce
 
     void setDoubleClick(uint16_t dClickInterval = DOUBLE_CLICK_INTERVAL, bool preventClick = true);
 
-    void check(uint32_t millisec = 0);
+    // Enables the InputGesture flags set in gestures
+    void setGestures(byte gestures);
+    inline byte gestures() {
+      return m_gestures;
+    }
+
+    // Takes the pin level from captured edges instead of reading the pin
+    void setCaptured(bool captured);
+    inline bool captured() {
+      return m_captured;
+    }
+    // Replays an edge captured at time
+    void edge(bool level, uint32_t time);
+
+    // Takes the pin level from a port of portScanner instead of reading the pin
+    void setScanned(int8_t port);
+    inline int8_t port() {
+      return m_port;
+    }
+    inline byte portMask() {
+      return m_mask;
+    }
+
+    // Returns false while the input can only change on an edge
+    bool active();
+
+    // Runs the input at time millisec, taken once per pass over the inputs
+    void check(uint32_t millisec);
     bool pressed();
     bool released();
 
@@ -188,7 +477,7 @@ class ML2Input : public Bounce
     }
 
     inline bool hold() {
-      return isHold;
+      return bState & ButtonState::HoldState;
     }
     bool down();
     bool up();
@@ -200,6 +489,11 @@ class ML2Input : public Bounce
   protected:
     void queueEvent(int event);
     void reset();
+    void process(bool level, uint32_t millisec);
+    void debounced(bool level, uint32_t millisec);
+    void track(uint32_t millisec);
+    void gesture(byte trigger);
+    void advance(uint32_t time);
 
   protected:
     int m_pin;
@@ -213,12 +507,99 @@ class ML2Input : public Bounce
     uint16_t m_doubleClickInterval;
     bool m_preventClick;
 
-    uint32_t buttonPressTimeStamp;
-    uint32_t lastRepeatTimeStamp;
-    bool isHold;
-    byte clickCount;
+    byte m_gestures;        // InputGesture flags
+    byte m_gesture;         // state of the gesture machine
+    uint32_t m_gestureTime; // last press, hold or repeat
     byte bState;
 
+    bool m_captured;
+    int8_t m_port;          // port in portScanner, -1 if read by digitalRead()
+    byte m_mask;
+    bool m_level;           // last captured pin level
+    bool m_settling;        // debouncing the last captured edge
+    uint32_t m_settleTime;
+
+};
+
+// Lock-free ring for one producer and one consumer, e.g. an interrupt
+// handler and the main loop. Each side only writes its own index, and byte
+// indexes are read and written atomically. N must be a power of two <= 128.
+template<class T, byte N>
+class SpscRing
+{
+  public:
+    SpscRing() : m_head(0), m_tail(0) {}
+
+    bool push(const T &item) {
+      byte tail = m_tail;
+      if ((byte)(tail - m_head) == N)
+        return false;
+
+      m_items[tail & (N - 1)] = item;
+      __asm__ __volatile__("" ::: "memory");  // store the item before publishing it
+      m_tail = tail + 1;
+      return true;
+    }
+
+    bool pop(T &item) {
+      byte head = m_head;
+      if (head == m_tail)
+        return false;
+
+      item = m_items[head & (N - 1)];
+      __asm__ __volatile__("" ::: "memory");
+      m_head = head + 1;
+      return true;
+    }
+
+  private:
+    T m_items[N];
+    volatile byte m_head;
+    volatile byte m_tail;
+};
+
+struct InputEdge {
+  byte input;               // position in inputList
+  byte level;
+  uint32_t time;            // millis() at the edge
+};
+
+#define CAPTURE_EDGES 32    // edges buffered between two buttonLoop() runs
+#define CAPTURE_BANKS 3     // pin change interrupt banks of the ATmega2560
+
+// Captures the edges of inputs on pins with a pin change interrupt. The
+// interrupt handlers push timestamped edges to a lock-free ring that
+// InputList::check() replays, so short presses are not lost while another
+// task blocks. Inputs on other pins are still polled.
+class InputCapture
+{
+  public:
+    InputCapture();
+
+    // Returns false if the input's pin has no pin change interrupt
+    bool attach(ML2Input *input, byte index);
+
+    inline bool pop(InputEdge &edge) {
+      return m_edges.pop(edge);
+    }
+    // Returns true once after edges were lost because the ring was full
+    bool overflowed();
+
+    // Called by the interrupt handlers
+    void scan(byte bank);
+
+  private:
+    struct Pin {
+      volatile uint8_t *reg;
+      uint8_t mask;
+      uint8_t input;
+      uint8_t level;
+    };
+
+    Pin m_pins[CAPTURE_BANKS][8];
+    byte m_cntPins[CAPTURE_BANKS];
+    SpscRing<InputEdge, CAPTURE_EDGES> m_edges;
+    volatile bool m_overflow;
 };
 
 #define RULES_PATH "/RULES"
@@ -240,8 +621,11 @@ class ML2Rule
 
     String ID;
     bool final;
+    bool deferred;
+    int8_t priority;       // higher runs first, equal priorities run in order of ID
 
     bool addInput(const char *id);
+    bool addGroup(const char *id);
 
     bool addOutput(const char *id);
     bool removeOutput(const char *id);
@@ -258,6 +642,10 @@ class ML2Rule
       return &outputlist;
     }
 
+    inline GroupList *groups() {
+      return &grouplist;
+    }
+
     EventAction &eventAction(ButtonEvent::Type event) {
       return eventActions[event];
     }
@@ -266,14 +654,163 @@ class ML2Rule
     void unsetAction(ButtonEvent::Type event);
     void setCondition(ButtonEvent::Type event, const char *condition);
 
-    bool processButtonEvent(int event, ML2Input *input);
-
   private:
     InputList inputlist;
     OutputList outputlist;
+    GroupList grouplist;
     EventAction eventActions[ButtonEvent::EventsCount];
 };
 
+#define RULE_ACTION_FINAL 0x01
+#define RULE_ACTION_DEFERRED 0x02   // apply through outputChannel on the next relayLoop
+#define RULE_ACTION_DISABLED 0x04   // part of a dependency cycle
+#define RULE_MAX_DEPENDENCIES 16    // outputs one condition of an output rule may read
+#define RULE_NO_CODE 0xFFFF
+
+// Counts rule matches and times event dispatch and condition evaluation.
+// Off by default, it costs two micros() calls per event and per evaluated
+// condition, and 16 bytes of RAM per rule.
+//#define PROFILE_RULES
+
+struct ProfileTime {
+  uint16_t count;
+  uint16_t minTime;                 // microseconds
+  uint16_t maxTime;
+  uint32_t totalTime;
+
+  inline void add(uint32_t t) {
+    uint16_t t16 = t > 0xFFFF ? 0xFFFF : t;
+    if (!count || t16 < minTime)
+      minTime = t16;
+    if (t16 > maxTime)
+      maxTime = t16;
+    totalTime += t16;
+    count++;
+  }
+};
+
+struct RuleProfile {
+  uint16_t matched;                 // actions whose condition held
+  uint16_t missed;                  // actions whose condition was false
+  uint16_t actions;                 // outputs, groups and scenes acted on
+  ProfileTime condition;
+};
+
+// Compiled, RAM-resident form of all rules.
+// Every assigned event action of every rule becomes one RuleAction with its
+// outputs resolved to pointers and its condition compiled to bytecode.
+// Actions are indexed per input and sorted by event, so a button event only
+// visits the actions it can trigger. OutputChanged actions are indexed by the
+// outputs their condition reads instead, so a changed output only re-evaluates
+// the rules depending on it.
+//
+// The table is built in two passes over the same rules:
+// begin(), count() for each rule, allocate(), add() for each rule, end().
+class RuleTable
+{
+  public:
+    struct RuleAction {
+      byte event;
+      byte action;
+      byte flags;
+      int8_t priority;
+      byte cntOutputs;
+      byte cntGroups;
+      uint16_t firstOutput;
+      uint16_t firstGroup;
+      uint16_t code;         // offset of the compiled condition or RULE_NO_CODE
+      int param;
+      uint32_t timeout;
+      uint16_t rule;         // position of the rule in the order of add()
+    };
+
+    RuleTable();
+    ~RuleTable();
+
+    void clear();
+
+    void begin();
+    void count(ML2Rule *rule);
+    bool allocate();
+    void add(ML2Rule *rule);
+    void end();
+
+    inline uint16_t actionCount() {
+      return m_cntActions;
+    }
+
+    bool processButtonEvent(int event, ML2Input *input);
+
+    // Marks the output for processOutputChanges()
+    void outputChanged(ML2Output *output);
+    void processOutputChanges();
+
+#ifdef PROFILE_RULES
+    inline const ProfileTime &eventProfile() {
+      return m_eventProfile;
+    }
+    inline const RuleProfile &ruleProfile(uint16_t rule) {
+      return m_ruleProfile[rule];
+    }
+    // Number of rules with a profile, 0 if there was no memory for it
+    inline uint16_t profiledRules() {
+      return m_ruleProfile ? m_maxRules : 0;
+    }
+    void resetProfile();
+#endif
+
+  private:
+    RuleAction *m_actions;
+    uint16_t m_cntActions;
+    uint16_t m_maxActions;
+
+    ML2Output **m_outputs;
+    uint16_t m_cntOutputs;
+    uint16_t m_maxOutputs;
+
+    ML2Group **m_groups;
+    uint16_t m_cntGroups;
+    uint16_t m_maxGroups;
+
+    byte *m_code;
+    uint16_t m_cntCode;
+    uint16_t m_maxCode;
+
+    uint16_t *m_slots;       // action indexes grouped by input, sorted by event
+    uint16_t *m_inputStart;  // first slot of every input, m_cntInputs + 1 entries
+    uint16_t *m_eventMask;   // events having at least one action, per input
+    byte m_cntInputs;
+
+    uint16_t *m_depSlots;    // OutputChanged action indexes grouped by the outputs they read
+    uint16_t *m_depStart;    // first dependency slot of every output, m_cntDepOutputs + 1 entries
+    byte *m_changed;         // bit set of outputs waiting for processOutputChanges()
+    bool m_anyChanged;
+    byte m_cntDepOutputs;
+
+    uint16_t m_cntRules;
+
+#ifdef PROFILE_RULES
+    ProfileTime m_eventProfile;
+    RuleProfile *m_ruleProfile;
+    uint16_t m_maxRules;
+#endif
+
+    int conditionSize(ML2Rule *rule, int event, bool report);
+    int dependencies(const byte *code, byte *outputs);
+    uint16_t allocateSlots(uint16_t *start, byte cnt);
+    uint16_t sortSlots(uint16_t *slots, uint16_t *start, byte cnt);
+    ML2Output *target(RuleAction &ra, byte i);
+    void checkCycles(byte out, byte *state);
+    bool dispatch(uint16_t *slots, uint16_t first, uint16_t last, int event);
+    void resolveTargets(ML2Rule *rule, ML2Output **outputs, byte &cntOutputs, ML2Group **groups, byte &cntGroups);
+    bool runsBefore(uint16_t a, uint16_t b);
+    bool matches(RuleAction &ra);
+    void apply(RuleAction &ra);
+};
+
+// Prints an applied output action when DEBUG_RULES is defined
+void printOutputAction(ML2Output *output, int action, int param);
+
 
 
 #endif //ML2CLASSES_H
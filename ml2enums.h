@@ -11,6 +11,9 @@ enum Type {
     LongClick,
     Click,
     DoubleClick,
+    OutputChanged, // an output a rule condition reads has changed
+    TripleClick,
+    ClickHold, // click, then press and hold
     EventsCount // must be last
 };
 }
@@ -23,6 +26,14 @@ enum PullupType {
 };
 }
 
+// Gestures an input recognizes on top of click, double click and hold
+namespace InputGesture {
+enum Gesture {
+    TripleClick = 0x01,
+    ClickHold = 0x02
+};
+}
+
 namespace ButtonState {
 enum State {
     Any = 0,
@@ -40,7 +51,15 @@ enum Action {
     Off,
     Toggle,
     Value,
-    IncValue
+    IncValue,
+    Scene
+};
+}
+
+namespace ExternalEvent {
+enum Type {
+    OutputState,
+    GroupState
 };
 }
 
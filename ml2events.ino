@@ -1,21 +1,41 @@
-EventManager inputEM(EventManager::kNotInterruptSafe);
-EventManager outputEM(EventManager::kNotInterruptSafe);
+InputChannel inputChannel;
+OutputChannel outputChannel;
 EventManager externalEM(EventManager::kNotInterruptSafe);
 
 bool externalEventsEnabled = false;
 
-void outputEventListener(int event, EventParam *param) {
-  OutputEventParam *p = reinterpret_cast<OutputEventParam *>(param);
-  ML2Output *output = static_cast<ML2Output *>(p->sender);
-
-  if (!output || !outputList.hasOutput(output))
+// Reports event parameters that had to be allocated on the heap because
+// their pool was exhausted
+void checkParamPools() {
+  static unsigned int reported = 0;
+  unsigned int fallbacks = EventParam::pool.getNumFallbacks();
+  if (fallbacks == reported)
     return;
 
-  output->action((OutputAction::Action)event, p->param, p->timeout);
+  Serialprint("Event parameter pool exhausted, %u heap allocations so far\r\n", fallbacks);
+  reported = fallbacks;
+}
+
+// Outputs are never removed once set up, so their positions stay valid
+void outputCommandListener(const OutputCommand &cmd) {
+  ML2Output *output = outputList.at(cmd.output);
+
+  output->action((OutputAction::Action)cmd.action, cmd.param, cmd.timeout);
+  printOutputAction(output, cmd.action, cmd.param);
+}
 
+bool sendOutputCommand(const OutputCommand &cmd) {
+  if (outputChannel.send(cmd))
+    return true;
+
+  Serialprint("Output %s: command queue full, action %d dropped\r\n", outputList.at(cmd.output)->ID, cmd.action);
+  return false;
+}
+
+void printOutputAction(ML2Output *output, int action, int param) {
 #ifdef DEBUG_RULES
   const char *id = output->ID;
-  switch (event) {
+  switch (action) {
     case OutputAction::NoAction:
       Serialprint("Output %s NoAction\r\n", id);
       break;
@@ -29,18 +49,19 @@ void outputEventListener(int event, EventParam *param) {
       Serialprint("Output %s Toggle\r\n", id);
       break;
     case OutputAction::Value:
-      Serialprint("Output %s Value=%d\r\n", id, p->param);
+      Serialprint("Output %s Value=%d\r\n", id, param);
       break;
     case OutputAction::IncValue:
-      Serialprint("Output %s IncValue=%d\r\n", id, p->param);
+      Serialprint("Output %s IncValue=%d\r\n", id, param);
       break;
   }
 #endif
 }
 
 
-void inputEventListener( int event, EventParam *param ) {
-  ML2Input *input = reinterpret_cast<ML2Input *>(param->sender);
+void inputEventListener(const InputEvent &e) {
+  ML2Input *input = inputList.at(e.input);
+  int event = e.event;
 
 #ifdef DEBUG_RULES
   const char *id = input->ID;
@@ -63,32 +84,70 @@ void inputEventListener( int event, EventParam *param ) {
     case ButtonEvent::DoubleClick:
       Serialprint("Button %s DoubleClick\r\n", id);
       break;
+    case ButtonEvent::TripleClick:
+      Serialprint("Button %s TripleClick\r\n", id);
+      break;
+    case ButtonEvent::ClickHold:
+      Serialprint("Button %s ClickHold\r\n", id);
+      break;
     case ButtonEvent::LongClick:
       Serialprint("Button %s LongClick\r\n", id);
       break;
   }
 #endif
 
-  for (SimpleList<int>::iterator itr = input->rules.begin(); itr != input->rules.end(); ++itr)
-  {
-    ML2Rule *rule = new ML2Rule("");
-    if (loadRuleEEPROM(rule, *itr, false)) {
-      if (rule->processButtonEvent(event, input))
-        if (rule->final)
-        {
-          delete rule;
-          break;
-        }
-    }
-    delete rule;
-  }
+  ruleTable.processButtonEvent(event, input);
 }
 
 EthernetClient client;
 
+// Time a report waits for the response before dropping the connection, in ms
+#define EXTERNAL_RESPONSE_WAIT 10
+
+bool connectExternal() {
+  if (!client.connected())
+    client.stop();
+
+  return client.connect(mdHost.c_str(), mdPort);
+}
+
+void finishExternalRequest() {
+  Streamprint(client, " HTTP/1.0\r\n");
+  Streamprint(client, "Host: %s\r\n", mdHost.c_str());
+  if (mdAuth.length())
+    Streamprint(client, "Authorization: Basic %s\r\n", mdAuth.c_str());
+  Streamprint(client, "Connection: close\r\n\r\n");
+  serviceLocal(EXTERNAL_RESPONSE_WAIT);
+  while (client.available()) {
+    client.read();
+  }
+  client.stop();
+}
+
+// Prints the IDs ('i'), on states ('o') or values ('v') of the reported outputs of a group
+void printGroupStates(ML2Group *group, char field) {
+  bool first = true;
+  for (OutputList::iterator itr = group->outputs()->begin(); itr != group->outputs()->end(); ++itr) {
+    ML2Output *output = (*itr);
+    if (output->noreport())
+      continue;
+
+    if (!first)
+      client.print(',');
+    first = false;
+
+    if (field == 'i')
+      Streamprint(client, "%s", output->ID);
+    else if (field == 'o')
+      Streamprint(client, "%d", output->on());
+    else
+      Streamprint(client, "%d", output->value());
+  }
+}
+
 void externalEventListener( int event, EventParam *param ) {
 
-  if (event == 0) // output event
+  if (event == ExternalEvent::OutputState)
   {
     ML2Output *output = reinterpret_cast<ML2Output *>(param->sender);
 
@@ -98,49 +157,51 @@ void externalEventListener( int event, EventParam *param ) {
     Serialprint("Status output %s State:%s Value:%d\r\n", output->ID, output->on() ? "On" : "Off", output->value());
 #endif
 
-    if (!client.connected())
-      client.stop();
-
-    if (client.connect(mdHost.c_str(), mdPort))
+    if (connectExternal())
     {
       Streamprint(client, "GET /objects/?object=ThisComputer&op=m&m=setRelayState");
       Streamprint(client, "&id=%s", output->ID);
       Streamprint(client, "&on=%d", output->on());
       Streamprint(client, "&v=%d", output->value());
-      Streamprint(client, " HTTP/1.0\r\n");
-      Streamprint(client, "Host: %s\r\n", mdHost.c_str());
-      if (mdAuth.length())
-        Streamprint(client, "Authorization: Basic %s\r\n", mdAuth.c_str());
-      Streamprint(client, "Connection: close\r\n\r\n");
-      delay(10);
-      while (client.available()) {
-        client.read();
-      }
-      client.stop();
+      finishExternalRequest();
     }
   }
+  else if (event == ExternalEvent::GroupState)
+  {
+    // one request for the whole group: id, on and v are comma separated lists
+    ML2Group *group = reinterpret_cast<ML2Group *>(param->sender);
+
+    int cntReported = 0;
+    for (OutputList::iterator itr = group->outputs()->begin(); itr != group->outputs()->end(); ++itr) {
+      saveOutputStateAndValue((*itr));
+      if (!(*itr)->noreport())
+        cntReported++;
+    }
+
+#ifdef DEBUG_RULES
+    Serialprint("Status group %s (%d outputs)\r\n", group->ID, cntReported);
+#endif
+
+    if (!cntReported || !connectExternal())
+      return;
+
+    Streamprint(client, "GET /objects/?object=ThisComputer&op=m&m=setRelayStates");
+    Streamprint(client, "&id=");
+    printGroupStates(group, 'i');
+    Streamprint(client, "&on=");
+    printGroupStates(group, 'o');
+    Streamprint(client, "&v=");
+    printGroupStates(group, 'v');
+    finishExternalRequest();
+  }
 }
 
-GenericCallable<void(int, EventParam*)> callableInputListener(&inputEventListener);
-GenericCallable<void(int, EventParam*)> callableOutputListener(&outputEventListener);
 GenericCallable<void(int, EventParam*)> callableExtrenalListener(&externalEventListener);
 
 void setupEMs() {
-  inputEM.addListener(ButtonEvent::StateChanged, &callableInputListener);
-  inputEM.addListener(ButtonEvent::Pressed     , &callableInputListener);
-  inputEM.addListener(ButtonEvent::Released    , &callableInputListener);
-  inputEM.addListener(ButtonEvent::Repeat      , &callableInputListener);
-  inputEM.addListener(ButtonEvent::Hold        , &callableInputListener);
-  inputEM.addListener(ButtonEvent::LongClick   , &callableInputListener);
-  inputEM.addListener(ButtonEvent::Click       , &callableInputListener);
-  inputEM.addListener(ButtonEvent::DoubleClick , &callableInputListener);
-
-  outputEM.addListener(OutputAction::NoAction, &callableOutputListener);
-  outputEM.addListener(OutputAction::On,       &callableOutputListener);
-  outputEM.addListener(OutputAction::Off,      &callableOutputListener);
-  outputEM.addListener(OutputAction::Toggle,   &callableOutputListener);
-  outputEM.addListener(OutputAction::Value,    &callableOutputListener);
-  outputEM.addListener(OutputAction::IncValue, &callableOutputListener);
+#ifdef COALESCE_OUTPUT_EVENTS
+  outputChannel.setMerge(true);
+#endif
 
 
   externalEM.setDefaultListener(&callableExtrenalListener);
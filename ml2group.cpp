@@ -0,0 +1,192 @@
+#include "ml2classes.h"
+
+extern bool externalEventsEnabled;
+extern EventManager externalEM;
+
+ML2Group::ML2Group(const String &id)
+{
+  id.toCharArray(ID, ID_SIZE);
+}
+
+void ML2Group::action(OutputAction::Action action, int param, uint32_t timeout)
+{
+  ML2Output::beginBatch();
+  for (OutputList::iterator itr = outputlist.begin(); itr != outputlist.end(); ++itr)
+  {
+    (*itr)->action(action, param, timeout);
+    printOutputAction((*itr), action, param);
+  }
+  ML2Output::endBatch();
+
+  emitState();
+}
+
+void ML2Group::emitState()
+{
+  if (externalEventsEnabled)
+    externalEM.queueEvent(ExternalEvent::GroupState, new EventParam(this));
+}
+
+GroupList::GroupList() : SimpleList<ML2Group * >()
+{
+}
+
+bool GroupList::addGroup(ML2Group *group)
+{
+  if (!group || find(group->ID))
+    return false;
+
+  this->push_back(group);
+  return true;
+}
+
+ML2Group *GroupList::find(const char* id)
+{
+  if (strlen(id))
+  {
+    for (GroupList::iterator itr = begin(); itr != end(); ++itr)
+    {
+      if (strcmp((*itr)->ID, id) == 0)
+        return (*itr);
+    }
+  }
+  return 0;
+}
+
+void GroupList::clearGroups()
+{
+  for (GroupList::iterator itr = this->begin(); itr != this->end(); ++itr)
+    delete (*itr);
+  this->clear();
+}
+
+
+ML2Scene::ML2Scene(const String &id, ML2Group *group)
+  : group(group)
+  , m_data(0)
+  , m_size(0)
+{
+  id.toCharArray(ID, ID_SIZE);
+
+  byte n = group->outputs()->size();
+  m_size = 2 * ((n + 7) / 8) + n;
+  if (m_size)
+  {
+    m_data = new byte[m_size];
+    if (m_data)
+      memset(m_data, 0, m_size);
+    else
+      m_size = 0;
+  }
+}
+
+ML2Scene::~ML2Scene()
+{
+  delete[] m_data;
+}
+
+bool ML2Scene::setStates(const char *states)
+{
+  byte n = group->outputs()->size();
+  byte maskSize = (n + 7) / 8;
+  if (!m_data)
+    return false;
+
+  memset(m_data, 0, m_size);
+
+  byte i = 0;
+  const char *s = states;
+  while (*s)
+  {
+    if (i == n)
+      return false;
+
+    while (*s == ' ')
+      s++;
+
+    byte bit = _BV(i & 7);
+    if (!strncmp(s, "on", 2))
+      m_data[i >> 3] |= bit;
+    else if (isdigit(*s))
+    {
+      m_data[i >> 3] |= bit;
+      m_data[maskSize + (i >> 3)] |= bit;
+      m_data[2 * maskSize + i] = constrain(atoi(s), 0, PWM_HIGH);
+    }
+    else if (strncmp(s, "off", 3))
+      return false;
+
+    i++;
+    s = strchr(s, ',');
+    if (!s)
+      break;
+    s++;
+  }
+
+  return i == n;
+}
+
+void ML2Scene::apply()
+{
+  byte maskSize = (group->outputs()->size() + 7) / 8;
+  if (!m_data)
+    return;
+
+  ML2Output::beginBatch();
+  byte i = 0;
+  for (OutputList::iterator itr = group->outputs()->begin(); itr != group->outputs()->end(); ++itr, ++i)
+  {
+    byte bit = _BV(i & 7);
+    bool on = m_data[i >> 3] & bit;
+    byte value = (m_data[maskSize + (i >> 3)] & bit) ? m_data[2 * maskSize + i] : (*itr)->value();
+    (*itr)->setState(on, value);
+  }
+  ML2Output::endBatch();
+
+  group->emitState();
+}
+
+SceneList::SceneList() : SimpleList<ML2Scene * >()
+{
+}
+
+bool SceneList::addScene(ML2Scene *scene)
+{
+  if (!scene || find(scene->ID))
+    return false;
+
+  this->push_back(scene);
+  return true;
+}
+
+ML2Scene *SceneList::find(const char* id)
+{
+  if (strlen(id))
+  {
+    for (SceneList::iterator itr = begin(); itr != end(); ++itr)
+    {
+      if (strcmp((*itr)->ID, id) == 0)
+        return (*itr);
+    }
+  }
+  return 0;
+}
+
+void SceneList::removeScenes(ML2Group *group)
+{
+  for (int i = size() - 1; i >= 0; i--)
+  {
+    if (at(i)->group != group)
+      continue;
+
+    delete at(i);
+    erase(begin() + i);
+  }
+}
+
+void SceneList::clearScenes()
+{
+  for (SceneList::iterator itr = this->begin(); itr != this->end(); ++itr)
+    delete (*itr);
+  this->clear();
+}
@@ -1,10 +1,113 @@
 #include "ml2classes.h"
 
-extern EventManager inputEM;
-
-inline bool byOrder(String a, String b) {
-  return a > b;
-}
+extern InputChannel inputChannel;
+extern InputCapture inputCapture;
+extern PortScanner portScanner;
+
+// States of the gesture machine
+#define GESTURE_IDLE        0
+#define GESTURE_DOWN1       1   // first press
+#define GESTURE_UP1         2   // released, waiting for a second press
+#define GESTURE_DOWN2       3
+#define GESTURE_UP2         4
+#define GESTURE_DOWN3       5
+#define GESTURE_HELD        6   // held after a press
+#define GESTURE_CLICK_HELD  7   // held after a click
+
+// Triggers
+#define GESTURE_PRESS       0
+#define GESTURE_RELEASE     1
+#define GESTURE_TIMEOUT     2
+
+// Conditions a transition can test, besides the InputGesture flags
+#define GESTURE_IF_DCLICK   0x10  // doubleclick interval set
+#define GESTURE_IF_PREVENT  0x20  // preventclick
+#define GESTURE_IF_REPEAT   0x40  // repeat
+
+#define GESTURE_NO_EVENT    0xFF
+
+// Timeout of each state and whether the button counts as held in it
+#define GESTURE_NO_TIMER      0
+#define GESTURE_HOLD_TIMER    1   // holdint after the press, if holdint is set
+#define GESTURE_DCLICK_TIMER  2   // dclickint after the press
+#define GESTURE_REPEAT_TIMER  3   // repeatint after the hold or repeat, if repeat is set
+#define GESTURE_TIMER_MASK    0x0F
+#define GESTURE_HOLDING       0x10
+
+static const byte gestureStates[] PROGMEM = {
+  GESTURE_NO_TIMER,                         // GESTURE_IDLE
+  GESTURE_HOLD_TIMER,                       // GESTURE_DOWN1
+  GESTURE_DCLICK_TIMER,                     // GESTURE_UP1
+  GESTURE_HOLD_TIMER,                       // GESTURE_DOWN2
+  GESTURE_DCLICK_TIMER,                     // GESTURE_UP2
+  GESTURE_HOLD_TIMER,                       // GESTURE_DOWN3
+  GESTURE_REPEAT_TIMER | GESTURE_HOLDING,   // GESTURE_HELD
+  GESTURE_REPEAT_TIMER | GESTURE_HOLDING,   // GESTURE_CLICK_HELD
+};
+
+struct GestureTransition
+{
+  byte state;
+  byte trigger;
+  byte mask;    // conditions the transition depends on
+  byte value;   // and their required values
+  byte next;
+  byte event;
+  byte event2;
+};
+
+#define T_  InputGesture::TripleClick
+#define C_  InputGesture::ClickHold
+#define D_  GESTURE_IF_DCLICK
+#define P_  GESTURE_IF_PREVENT
+#define R_  GESTURE_IF_REPEAT
+#define NO_ GESTURE_NO_EVENT
+
+// The first transition of the state matching the trigger and conditions is
+// taken. Clicks are held back while a longer gesture can still follow only
+// with preventclick.
+static const GestureTransition gestureTransitions[] PROGMEM = {
+  { GESTURE_IDLE,       GESTURE_PRESS,   0,       0,       GESTURE_DOWN1,      NO_,                      NO_ },
+
+  { GESTURE_DOWN1,      GESTURE_TIMEOUT, R_,      R_,      GESTURE_HELD,       ButtonEvent::Hold,        ButtonEvent::Repeat },
+  { GESTURE_DOWN1,      GESTURE_TIMEOUT, 0,       0,       GESTURE_HELD,       ButtonEvent::Hold,        NO_ },
+  { GESTURE_DOWN1,      GESTURE_RELEASE, D_,      0,       GESTURE_IDLE,       ButtonEvent::Click,       NO_ },
+  { GESTURE_DOWN1,      GESTURE_RELEASE, P_,      0,       GESTURE_UP1,        ButtonEvent::Click,       NO_ },
+  { GESTURE_DOWN1,      GESTURE_RELEASE, 0,       0,       GESTURE_UP1,        NO_,                      NO_ },
+
+  { GESTURE_UP1,        GESTURE_TIMEOUT, P_,      P_,      GESTURE_IDLE,       ButtonEvent::Click,       NO_ },
+  { GESTURE_UP1,        GESTURE_TIMEOUT, 0,       0,       GESTURE_IDLE,       NO_,                      NO_ },
+  { GESTURE_UP1,        GESTURE_PRESS,   0,       0,       GESTURE_DOWN2,      NO_,                      NO_ },
+
+  { GESTURE_DOWN2,      GESTURE_TIMEOUT, C_ | R_, C_ | R_, GESTURE_CLICK_HELD, ButtonEvent::ClickHold,   ButtonEvent::Repeat },
+  { GESTURE_DOWN2,      GESTURE_TIMEOUT, C_,      C_,      GESTURE_CLICK_HELD, ButtonEvent::ClickHold,   NO_ },
+  { GESTURE_DOWN2,      GESTURE_TIMEOUT, R_,      R_,      GESTURE_HELD,       ButtonEvent::Hold,        ButtonEvent::Repeat },
+  { GESTURE_DOWN2,      GESTURE_TIMEOUT, 0,       0,       GESTURE_HELD,       ButtonEvent::Hold,        NO_ },
+  { GESTURE_DOWN2,      GESTURE_RELEASE, T_,      0,       GESTURE_IDLE,       ButtonEvent::DoubleClick, NO_ },
+  { GESTURE_DOWN2,      GESTURE_RELEASE, P_,      0,       GESTURE_UP2,        ButtonEvent::DoubleClick, NO_ },
+  { GESTURE_DOWN2,      GESTURE_RELEASE, 0,       0,       GESTURE_UP2,        NO_,                      NO_ },
+
+  { GESTURE_UP2,        GESTURE_TIMEOUT, P_,      P_,      GESTURE_IDLE,       ButtonEvent::DoubleClick, NO_ },
+  { GESTURE_UP2,        GESTURE_TIMEOUT, 0,       0,       GESTURE_IDLE,       NO_,                      NO_ },
+  { GESTURE_UP2,        GESTURE_PRESS,   0,       0,       GESTURE_DOWN3,      NO_,                      NO_ },
+
+  { GESTURE_DOWN3,      GESTURE_TIMEOUT, R_,      R_,      GESTURE_HELD,       ButtonEvent::Hold,        ButtonEvent::Repeat },
+  { GESTURE_DOWN3,      GESTURE_TIMEOUT, 0,       0,       GESTURE_HELD,       ButtonEvent::Hold,        NO_ },
+  { GESTURE_DOWN3,      GESTURE_RELEASE, 0,       0,       GESTURE_IDLE,       ButtonEvent::TripleClick, NO_ },
+
+  { GESTURE_HELD,       GESTURE_TIMEOUT, 0,       0,       GESTURE_HELD,       ButtonEvent::Repeat,      NO_ },
+  { GESTURE_HELD,       GESTURE_RELEASE, 0,       0,       GESTURE_IDLE,       ButtonEvent::LongClick,   NO_ },
+
+  { GESTURE_CLICK_HELD, GESTURE_TIMEOUT, 0,       0,       GESTURE_CLICK_HELD, ButtonEvent::Repeat,      NO_ },
+  { GESTURE_CLICK_HELD, GESTURE_RELEASE, 0,       0,       GESTURE_IDLE,       NO_,                      NO_ },
+};
+
+#undef T_
+#undef C_
+#undef D_
+#undef P_
+#undef R_
+#undef NO_
 
 ML2Input::ML2Input(const String &id)
   : Bounce()
@@ -16,10 +119,16 @@ ML2Input::ML2Input(const String &id)
   , m_repeatInterval(REPEAT_INTERVAL)
   , m_doubleClickInterval(0)
   , m_preventClick(false)
-  , buttonPressTimeStamp(0)
-  , lastRepeatTimeStamp(0)
-  , clickCount(0)
-  , isHold(false)
+  , m_gestures(0)
+  , m_gesture(0)
+  , m_gestureTime(0)
+  , index(0)
+  , m_captured(false)
+  , m_port(-1)
+  , m_mask(0)
+  , m_level(false)
+  , m_settling(false)
+  , m_settleTime(0)
 {
   id.toCharArray(ID, ID_SIZE);
   this->setPin(m_pin);
@@ -63,6 +172,11 @@ void ML2Input::setDoubleClick(uint16_t dClickInterval, bool preventClick)
   this->m_preventClick = preventClick;
 }
 
+void ML2Input::setGestures(byte gestures)
+{
+  this->m_gestures = gestures;
+}
+
 void ML2Input::setPullup(InputPullup::PullupType pullup)
 {
   this->m_pullup = pullup;
@@ -98,96 +212,219 @@ inline bool ML2Input::up()
 
 inline void ML2Input::queueEvent(int event)
 {
-  inputEM.queueEvent(event, new EventParam(this));
+  if (!inputChannel.send(InputEvent(index, event)))
+    Serialprint("Input %s: event queue full, event %d dropped\r\n", ID, event);
 }
 
 void ML2Input::reset()
 {
   this->attach(m_pin);
   this->bState = up() ? ButtonState::Up : ButtonState::Down;
+  this->m_gesture = up() ? GESTURE_IDLE : GESTURE_DOWN1;
+  this->m_gestureTime = millis();
+}
+
+void ML2Input::setCaptured(bool captured)
+{
+  m_captured = captured;
+  m_level = digitalRead(m_pin);
+  m_settling = false;
+}
+
+// The scanner debounces by counting scans, which run every buttonLoop()
+// tick of 1 ms: a level stable for bounceint ms has been seen bounceint + 1
+// times, up to PORTSCANNER_MAX_DEPTH
+void ML2Input::setScanned(int8_t port)
+{
+  m_port = port;
+  m_mask = digitalPinToBitMask(m_pin);
+  portScanner.setDepth(port, m_mask, min(m_bounceInterval + 1, PORTSCANNER_MAX_DEPTH));
+}
+
+void ML2Input::edge(bool level, uint32_t time)
+{
+  // the previous level lasted until the edge
+  advance(time);
+
+  m_level = level;
+  process(level, time);
+  m_settleTime = time + interval_millis;
+  m_settling = true;
+}
+
+// Runs the captured level up to time. Edges may be replayed long after they
+// happened, so a debounce still settling is completed at the moment polling
+// would have seen it, keeping press and release times accurate.
+void ML2Input::advance(uint32_t time)
+{
+  if (m_settling && (long)(time - m_settleTime) >= 0)
+  {
+    m_settling = false;
+    process(m_level, m_settleTime);
+  }
+
+  process(m_level, time);
+}
+
+bool ML2Input::active()
+{
+  // polled inputs have to be read on every pass
+  if (!m_captured && m_port < 0)
+    return true;
+
+  return m_settling || m_gesture != GESTURE_IDLE;
 }
 
 void ML2Input::check(uint32_t millisec)
 {
-  if (!millisec)
-    millisec = millis();
+  if (m_captured)
+    advance(millisec);
+  else if (m_port >= 0)
+    debounced(portScanner.read(m_port, m_mask), millisec);
+  else
+    process(digitalRead(m_pin), millisec);
+}
+
+void ML2Input::process(bool level, uint32_t millisec)
+{
+  if (this->update(level, millisec))
+    queueEvent(ButtonEvent::StateChanged);
 
-  if (this->update())
+  track(millisec);
+}
+
+void ML2Input::debounced(bool level, uint32_t millisec)
+{
+  if (this->set(level))
     queueEvent(ButtonEvent::StateChanged);
 
-  if (up() && (clickCount > 0) && (millisec - buttonPressTimeStamp) >= m_doubleClickInterval)
+  track(millisec);
+}
+
+// Turns the debounced state into button events
+void ML2Input::track(uint32_t millisec)
+{
+  bool timed = false;
+  uint16_t timeout = 0;
+  switch (pgm_read_byte(&gestureStates[m_gesture]) & GESTURE_TIMER_MASK)
   {
-    if (clickCount == 1 && m_preventClick)
-      queueEvent(ButtonEvent::Click);
+    case GESTURE_HOLD_TIMER:
+      timed = m_holdInterval;
+      timeout = m_holdInterval;
+      break;
+    case GESTURE_DCLICK_TIMER:
+      timed = true;
+      timeout = m_doubleClickInterval;
+      break;
+    case GESTURE_REPEAT_TIMER:
+      timed = m_repeat;
+      timeout = m_repeatInterval;
+      break;
+  }
 
-    clickCount = 0;
+  if (timed && (millisec - m_gestureTime) >= timeout)
+  {
+    m_gestureTime = millisec;
+    gesture(GESTURE_TIMEOUT);
   }
 
   if (this->pressed())
   {
-    buttonPressTimeStamp = millisec;
     bState = ButtonState::Down;
     queueEvent(ButtonEvent::Pressed);
+    m_gestureTime = millisec;
+    gesture(GESTURE_PRESS);
   }
 
   if (this->released())
   {
+    bState = ButtonState::Up;
     queueEvent(ButtonEvent::Released);
+    gesture(GESTURE_RELEASE);
+  }
+}
 
-    if (m_holdInterval && ((millisec - buttonPressTimeStamp) >= m_holdInterval))
-    {
-      queueEvent(ButtonEvent::LongClick);
-    }
-    else
-    {
-      if (this->m_doubleClickInterval > 0)
-      {
-        if (++clickCount == 1 && !m_preventClick)
-          queueEvent(ButtonEvent::Click);
+void ML2Input::gesture(byte trigger)
+{
+  byte conditions = m_gestures;
+  if (m_doubleClickInterval)
+    conditions |= GESTURE_IF_DCLICK;
+  if (m_preventClick)
+    conditions |= GESTURE_IF_PREVENT;
+  if (m_repeat)
+    conditions |= GESTURE_IF_REPEAT;
+
+  for (byte i = 0; i < sizeof(gestureTransitions) / sizeof(GestureTransition); i++)
+  {
+    GestureTransition t;
+    memcpy_P(&t, &gestureTransitions[i], sizeof(t));
+    if (t.state != m_gesture || t.trigger != trigger || (conditions & t.mask) != t.value)
+      continue;
 
-        if (clickCount == 2)
-          queueEvent(ButtonEvent::DoubleClick);
-      }
-      else
-      {
-        queueEvent(isHold ? ButtonEvent::LongClick : ButtonEvent::Click);
-      }
-    }
+    m_gesture = t.next;
+    if (pgm_read_byte(&gestureStates[m_gesture]) & GESTURE_HOLDING)
+      bState |= ButtonState::HoldState;
 
-    isHold = false;
-    bState = ButtonState::Up;
+    if (t.event != GESTURE_NO_EVENT)
+      queueEvent(t.event);
+    if (t.event2 != GESTURE_NO_EVENT)
+      queueEvent(t.event2);
+    return;
   }
+}
 
-  if (down())
-  {
-    if (!buttonPressTimeStamp)
-      buttonPressTimeStamp = millisec;
+InputList::InputList() : SimpleList<ML2Input * >()
+  , m_active(0)
+  , m_cntActive(0)
+  , m_isActive(0)
+{
 
-    if (m_repeat && isHold && (millisec - lastRepeatTimeStamp) >= m_repeatInterval)
-    {
-      lastRepeatTimeStamp = millisec;
-      queueEvent(ButtonEvent::Repeat);
-    }
+}
 
-    if (!isHold && m_holdInterval && (millisec - buttonPressTimeStamp) >= m_holdInterval)
-    {
-      queueEvent(ButtonEvent::Hold);
-      isHold = true;
-      bState |= ButtonState::HoldState;
+bool InputList::setupActive()
+{
+  delete[] m_active;
+  delete[] m_isActive;
+  m_cntActive = 0;
 
-      if (m_repeat && (millisec - buttonPressTimeStamp) >= m_holdInterval)
-      {
-        lastRepeatTimeStamp = millisec;
-        queueEvent(ButtonEvent::Repeat);
-      }
+  m_active = new byte[size()];
+  m_isActive = new byte[(size() + 7) / 8];
+  if (!m_active || !m_isActive)
+  {
+    delete[] m_active;
+    delete[] m_isActive;
+    m_active = m_isActive = 0;
+    return false;
+  }
+
+  memset(m_isActive, 0, (size() + 7) / 8);
+  memset(m_portInputs, 0xFF, sizeof(m_portInputs));
 
+  for (byte i = 0; i < size(); i++)
+  {
+    ML2Input *input = at(i);
+    if (input->port() >= 0)
+    {
+      byte bit = 0;
+      while (!(input->portMask() & (1 << bit)))
+        bit++;
+      m_portInputs[input->port()][bit] = i;
     }
+
+    // every input starts active and leaves the set on its first idle pass
+    activate(i);
   }
+
+  return true;
 }
 
-InputList::InputList() : SimpleList<ML2Input * >()
+void InputList::activate(byte index)
 {
+  if (!m_active || (m_isActive[index / 8] & (1 << (index % 8))))
+    return;
 
+  m_isActive[index / 8] |= 1 << (index % 8);
+  m_active[m_cntActive++] = index;
 }
 
 bool InputList::addInput(ML2Input *input)
@@ -245,26 +482,158 @@ ML2Input *InputList::find(const char *id)
 
 void InputList::check()
 {
-  for (InputList::iterator itr = begin(); itr != end(); ++itr)
+  // Edges captured after this point are handled on the next call, so
+  // every input sees its time go forward
+  uint32_t now = millis();
+
+  InputEdge edge;
+  while (inputCapture.pop(edge))
   {
-    (*itr)->check();
+    if ((long)(edge.time - now) > 0)
+      edge.time = now;
+    if (edge.input < size())
+    {
+      at(edge.input)->edge(edge.level, edge.time);
+      activate(edge.input);
+    }
+  }
+
+  // lost edges leave the captured levels behind the pins, the pin level is
+  // taken as a fresh edge so it is debounced before the input goes idle
+  if (inputCapture.overflowed())
+  {
+    for (byte i = 0; i < size(); i++)
+    {
+      if (at(i)->captured())
+      {
+        at(i)->edge(digitalRead(at(i)->pin()), now);
+        activate(i);
+      }
+    }
+  }
+
+  portScanner.scan();
+
+  if (!m_active)
+  {
+    for (InputList::iterator itr = begin(); itr != end(); ++itr)
+      (*itr)->check(now);
+    return;
+  }
+
+  for (byte port = 0; port < portScanner.size(); port++)
+  {
+    byte changed = portScanner.changed(port);
+    for (byte bit = 0; changed; bit++, changed >>= 1)
+    {
+      if ((changed & 1) && m_portInputs[port][bit] != 0xFF)
+        activate(m_portInputs[port][bit]);
+    }
+  }
+
+  for (byte i = 0; i < m_cntActive; )
+  {
+    byte index = m_active[i];
+    ML2Input *input = at(index);
+    input->check(now);
+
+    if (input->active())
+    {
+      i++;
+      continue;
+    }
+
+    m_isActive[index / 8] &= ~(1 << (index % 8));
+    m_active[i] = m_active[--m_cntActive];
   }
 }
 
 void InputList::clearInputs()
 {
-  for (InputList::iterator itr = this->begin(); itr != this->end(); ++itr)
+  for (InputList::iterator itr = begin(); itr != this->end(); ++itr)
     delete (*itr);
   this->clear();
+
+  delete[] m_active;
+  delete[] m_isActive;
+  m_active = m_isActive = 0;
+  m_cntActive = 0;
 }
 
-bool InputList::addInputRule(const char *inputId, int addrRule) {
-  ML2Input *input = find(inputId);
-  if (!input)
+InputCapture::InputCapture()
+  : m_overflow(false)
+{
+  memset(m_cntPins, 0, sizeof(m_cntPins));
+}
+
+bool InputCapture::attach(ML2Input *input, byte index)
+{
+  byte pin = input->pin();
+  volatile uint8_t *pcicr = digitalPinToPCICR(pin);
+  if (!pcicr)
+    return false;
+
+  byte bank = digitalPinToPCICRbit(pin);
+  if (bank >= CAPTURE_BANKS || m_cntPins[bank] >= 8)
     return false;
-    
-  input->rules.push_back(addrRule);
-//  input->rules.sort(byOrder);
+
+  uint8_t sreg = SREG;
+  cli();
+
+  Pin &p = m_pins[bank][m_cntPins[bank]];
+  p.reg = portInputRegister(digitalPinToPort(pin));
+  p.mask = digitalPinToBitMask(pin);
+  p.input = index;
+  p.level = (*p.reg & p.mask) ? 1 : 0;
+  m_cntPins[bank]++;
+
+  input->setCaptured(true);
+
+  *digitalPinToPCMSK(pin) |= _BV(digitalPinToPCMSKbit(pin));
+  *pcicr |= _BV(bank);
+
+  SREG = sreg;
   return true;
 }
 
+bool InputCapture::overflowed()
+{
+  if (!m_overflow)
+    return false;
+
+  m_overflow = false;
+  return true;
+}
+
+void InputCapture::scan(byte bank)
+{
+  // the interrupt only tells the bank, so compare every captured pin in it
+  uint32_t now = millis();
+  Pin *p = m_pins[bank];
+  for (byte i = 0; i < m_cntPins[bank]; i++, p++)
+  {
+    byte level = (*p->reg & p->mask) ? 1 : 0;
+    if (level == p->level)
+      continue;
+
+    p->level = level;
+    InputEdge edge = { p->input, level, now };
+    if (!m_edges.push(edge))
+      m_overflow = true;
+  }
+}
+
+ISR(PCINT0_vect)
+{
+  inputCapture.scan(0);
+}
+
+ISR(PCINT1_vect)
+{
+  inputCapture.scan(1);
+}
+
+ISR(PCINT2_vect)
+{
+  inputCapture.scan(2);
+}
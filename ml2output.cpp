@@ -3,6 +3,63 @@
 extern bool externalEventsEnabled;
 extern EventManager externalEM;
 extern OutputList outputList;
+extern RuleTable ruleTable;
+
+byte ML2Output::s_batch = 0;
+
+static inline bool isValueAction(int action)
+{
+  return action == OutputAction::Value || action == OutputAction::IncValue;
+}
+
+static inline bool isStateAction(int action)
+{
+  return action == OutputAction::On || action == OutputAction::Off || action == OutputAction::Toggle;
+}
+
+ChannelMerge::Result OutputCommand::merge(OutputCommand &queued, const OutputCommand &cmd)
+{
+  if (queued.output != cmd.output)
+    return ChannelMerge::Unrelated;
+
+  if (isValueAction(queued.action) && isValueAction(cmd.action))
+  {
+    if (cmd.action == OutputAction::Value)
+    {
+      queued = cmd;
+      return ChannelMerge::Merged;
+    }
+
+    // increments only add up when they dim alike
+    if (queued.timeout != cmd.timeout)
+      return ChannelMerge::Blocked;
+
+    queued.param += cmd.param;
+    if (queued.action == OutputAction::Value)
+      queued.param = constrain(queued.param, 0, PWM_HIGH);
+    return ChannelMerge::Merged;
+  }
+
+  if (isStateAction(queued.action) && isStateAction(cmd.action))
+  {
+    if (cmd.action != OutputAction::Toggle)
+      queued.action = cmd.action;
+    else if (queued.action != OutputAction::Toggle)
+      queued.action = (queued.action == OutputAction::On) ? OutputAction::Off : OutputAction::On;
+    else
+      return ChannelMerge::Blocked;
+
+    queued.param = cmd.param;
+    queued.timeout = cmd.timeout;
+    return ChannelMerge::Merged;
+  }
+
+  // NoAction refreshes the pin and must keep its place
+  if (queued.action == OutputAction::NoAction || cmd.action == OutputAction::NoAction)
+    return ChannelMerge::Blocked;
+
+  return ChannelMerge::Unrelated;
+}
 
 ML2Output::ML2Output(const String &id)
   : m_pin(0)
@@ -17,6 +74,7 @@ ML2Output::ML2Output(const String &id)
   , m_invert(false)
   , m_saveState(OutputStateSave::None)
   , m_value(0)
+  , index(0)
 {
   id.toCharArray(ID, ID_SIZE);
   setupPin();
@@ -86,6 +144,14 @@ void ML2Output::incValue(int val, uint32_t timeout)
   setValue(val, timeout);
 }
 
+void ML2Output::setState(bool on, byte value, uint32_t timeout)
+{
+  m_on = on;
+  m_value = value;
+  m_dim_t1 = 0;
+  updatePin(timeout);
+}
+
 bool ML2Output::action(OutputAction::Action action, int param, uint32_t timeout)
 {
   switch (action) {
@@ -218,8 +284,10 @@ void ML2Output::updatePin(uint32_t timeout, bool doEmit)
 
 void ML2Output::emitState()
 {
-  if (externalEventsEnabled && !this->m_noreport)
-    externalEM.queueEvent(0, new EventParam(this));
+  ruleTable.outputChanged(this);
+
+  if (externalEventsEnabled && !this->m_noreport && !s_batch)
+    externalEM.queueEvent(ExternalEvent::OutputState, new EventParam(this));
 }
 
 OutputList::OutputList() : SimpleList<ML2Output * >()
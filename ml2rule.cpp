@@ -2,9 +2,10 @@
 
 #include <SDConfigFile.h>
 
-extern EventManager outputEM;
 extern OutputList outputList;
 extern InputList inputList;
+extern GroupList groupList;
+extern SceneList sceneList;
 
 uint32_t parseTime(const char* v) {
   String s = v;
@@ -42,84 +43,120 @@ uint32_t parseTime(const char* v) {
   return r + strtoul(s.c_str(), NULL, 10);
 }
 
-int eval_token(char *expr)
+// Condition token handles: the high byte is the token kind, the low byte
+// the index of the output or input
+#define TOKEN_OUTPUT_ON    0x00
+#define TOKEN_OUTPUT_VALUE 0x10
+#define TOKEN_INPUT        0x20
+#define TOKEN_STATE_MASK   0x0F
+
+int resolve_token(char *token)
 {
-  String s = expr;
-  s.trim();
-  if (!s.length())
-    return 0;
+  char id[EXPR_MAX_TOKEN];
+  strcpy(id, token);
+  strupr(id);
 
-  s.toUpperCase();
+  int handle = EVAL_FAILURE;
+  char *name = id + 1;
 
-  char c = s[0];
-  if ((c == 'R') || (c == 'V'))
+  if (id[0] == 'R' || id[0] == 'V')
   {
-    bool needValue = (c == 'V');
-    s.remove(0, 1);
-    c = s[0];
-
-    int i = 0;
-    while (c && ExpressionEvaluator::istoken_char(c))
-      c = s[++i];
-    s.remove(i);
-
-    ML2Output *output = outputList.find(s.c_str());
-    if (output)
-      return needValue ? output->value() : (output->on() ? 1 : 0);
+    int index = outputList.indexOf(outputList.find(name));
+    if (index != -1)
+      handle = ((id[0] == 'V' ? TOKEN_OUTPUT_VALUE : TOKEN_OUTPUT_ON) << 8) | index;
   }
-  else if (c == 'B')
+  else if (id[0] == 'B')
   {
-    s.remove(0, 1);
     ButtonState::State state;
-    c = s[0];
-    switch (c) {
+    switch (*name) {
       case 'U' :
         state = ButtonState::Up;
-        s.remove(0, 1);
-        c = s[0];
+        name++;
         break;
       case 'H' :
         state = ButtonState::HoldState;
-        s.remove(0, 1);
-        c = s[0];
+        name++;
         break;
       default:
         state = ButtonState::Down;
     }
 
-    int i = 0;
-    while (c && ExpressionEvaluator::istoken_char(c))
-      c = s[++i];
-    s.remove(i);
-
-    ML2Input *input = inputList.find(s.c_str());
-    if (input)
-      return input->state() == state ? 1 : 0;
-  }
-  else
-  {
-    return s.toInt();
+    int index = inputList.indexOf(inputList.find(name));
+    if (index != -1)
+      handle = ((TOKEN_INPUT | state) << 8) | index;
   }
 
-  return 0;
+  if (handle == EVAL_FAILURE)
+    Serialprint("Unknown identifier %s\r\n", token);
+
+  return handle;
 }
 
-GenericTokenEvaluator<int(char*)> tokenEvaluator(&eval_token);
-ExpressionEvaluator evaluator(&tokenEvaluator);
-bool evalRuleExpr(const String &expr)
+int eval_handle(uint16_t handle)
 {
-  int r = evaluator.eval(expr.c_str());
+  byte kind = handle >> 8;
+  byte index = handle & 0xFF;
+
+  switch (kind & ~TOKEN_STATE_MASK) {
+    case TOKEN_OUTPUT_ON:
+      return outputList.at(index)->on() ? 1 : 0;
+    case TOKEN_OUTPUT_VALUE:
+      return outputList.at(index)->value();
+    default:
+      return (inputList.at(index)->state() & kind & TOKEN_STATE_MASK) ? 1 : 0;
+  }
+}
+
+GenericTokenResolver<int(char*)> tokenResolver(&resolve_token);
+GenericHandleEvaluator<int(uint16_t)> handleEvaluator(&eval_handle);
+ExpressionEvaluator evaluator(0);
+
+int compileRuleExpr(const String &expr, byte *code, int size)
+{
+  int r = evaluator.compile(expr.c_str(), code, size, &tokenResolver, EXPR_SHORT_CIRCUIT);
   if (r == EVAL_FAILURE)
+    Serialprint("Error compiling expression: %s\r\n", expr.c_str());
+  return r;
+}
+
+bool runRuleExpr(const byte *code)
+{
+  return ExpressionEvaluator::run(code, &handleEvaluator) != 0;
+}
+
+int ruleExprOutputs(const byte *code, byte *outputs, int size)
+{
+  // every token takes at least four bytes of code
+  uint16_t handles[EXPR_MAX_CODE / 4];
+  int cntHandles = ExpressionEvaluator::handles(code, handles, EXPR_MAX_CODE / 4);
+
+  int n = 0;
+  for (int i = 0; i < cntHandles; i++)
   {
-    Serialprint("Error evaluating expression: %s", expr.c_str());
-    return false;
+    byte kind = handles[i] >> 8;
+    if (kind != TOKEN_OUTPUT_ON && kind != TOKEN_OUTPUT_VALUE)
+      continue;
+
+    // RLED and VLED are the same output
+    byte index = handles[i] & 0xFF;
+    int j = 0;
+    while (j < n && outputs[j] != index)
+      j++;
+    if (j == n)
+    {
+      if (n == size)
+        return -1;
+      outputs[n++] = index;
+    }
   }
-  return r != 0;
+  return n;
 }
 
 ML2Rule::ML2Rule(const String &id)
   : ID(id)
   , final(false)
+  , deferred(false)
+  , priority(0)
 {
   for (int i = 0; i < ButtonEvent::EventsCount; i++)
   {
@@ -133,6 +170,7 @@ ML2Rule::ML2Rule(const String &id)
 ML2Rule::~ML2Rule()
 {
   clearOutputs();
+  grouplist.clear();
 }
 
 
@@ -155,6 +193,15 @@ bool ML2Rule::hasOutput(ML2Output *output)
   return false;
 }
 
+bool ML2Rule::addGroup(const char *id)
+{
+  ML2Group *group = groupList.find(id);
+  if (!group)
+    return false;
+
+  return grouplist.addGroup(group);
+}
+
 bool ML2Rule::addOutput(const char *id)
 {
   ML2Output *output = outputList.find(id);
@@ -217,21 +264,6 @@ void ML2Rule::setCondition(ButtonEvent::Type event, const char *condition)
   eventActions[event].condition = condition;
 }
 
-bool ML2Rule::processButtonEvent(int event, ML2Input *input)
-{
-  OutputAction::Action action = eventActions[event].action;
-  if (action == OutputAction::Unassigned)
-    return false;
-
-  if (eventActions[event].condition.length() && !evalRuleExpr(eventActions[event].condition))
-    return false;
-
-  for (OutputList::iterator itr = outputlist.begin(); itr != outputlist.end(); ++itr)
-    outputEM.queueEvent(action, new OutputEventParam((*itr), eventActions[event].param, eventActions[event].timeout));
-
-  return true;
-}
-
 ML2Rule *ML2Rule::fromFile(const String &path) {
   const uint8_t CONFIG_LINE_LENGTH = 127;
 
@@ -253,6 +285,12 @@ ML2Rule *ML2Rule::fromFile(const String &path) {
     if (cfg.nameIs("final")) {
       rule->final = cfg.getBooleanValue();
 
+    } else if (cfg.nameIs("deferred")) {
+      rule->deferred = cfg.getBooleanValue();
+
+    } else if (cfg.nameIs("priority")) {
+      rule->priority = constrain(cfg.getIntValue(), -128, 127);
+
     } else if (cfg.nameIs("input")) {
       String inputId = cfg.getValue();
       inputId.toUpperCase();
@@ -266,6 +304,13 @@ ML2Rule *ML2Rule::fromFile(const String &path) {
       if (!rule->addOutput(outputId.c_str()))
         Serialprint("Could not add output %s to rule %s\r\n", outputId.c_str(), path.c_str());
 
+    } else if (cfg.nameIs("group")) {
+      String groupId = cfg.getValue();
+      groupId.toUpperCase();
+
+      if (!rule->addGroup(groupId.c_str()))
+        Serialprint("Could not add group %s to rule %s\r\n", groupId.c_str(), path.c_str());
+
     } else if (cfg.nameIs("event")) {
       String pu = cfg.getValue();
       if (pu == "change")
@@ -284,6 +329,12 @@ ML2Rule *ML2Rule::fromFile(const String &path) {
         currEvent = ButtonEvent::Click;
       else if (pu == "dclick")
         currEvent = ButtonEvent::DoubleClick;
+      else if (pu == "tclick")
+        currEvent = ButtonEvent::TripleClick;
+      else if (pu == "clickhold")
+        currEvent = ButtonEvent::ClickHold;
+      else if (pu == "output")
+        currEvent = ButtonEvent::OutputChanged;
 
     } else if (cfg.nameIs("action") && (currEvent != ButtonEvent::EventsCount)) {
       String pu = cfg.getValue();
@@ -299,10 +350,20 @@ ML2Rule *ML2Rule::fromFile(const String &path) {
         rule->eventAction(currEvent).action = OutputAction::Value;
       else if (pu == "incvalue")
         rule->eventAction(currEvent).action = OutputAction::IncValue;
+      else if (pu == "scene")
+        rule->eventAction(currEvent).action = OutputAction::Scene;
 
     } else if (cfg.nameIs("param") && (currEvent != ButtonEvent::EventsCount)) {
       rule->eventAction(currEvent).param = cfg.getIntValue();
 
+    } else if (cfg.nameIs("scene") && (currEvent != ButtonEvent::EventsCount)) {
+      String sceneId = cfg.getValue();
+      sceneId.toUpperCase();
+
+      rule->eventAction(currEvent).param = sceneList.indexOf(sceneList.find(sceneId.c_str()));
+      if (rule->eventAction(currEvent).param < 0)
+        Serialprint("Could not find scene %s for rule %s\r\n", sceneId.c_str(), path.c_str());
+
     } else if (cfg.nameIs("timeout") && (currEvent != ButtonEvent::EventsCount)) {
       rule->eventAction(currEvent).timeout = parseTime(cfg.getValue());
 
@@ -315,6 +376,19 @@ ML2Rule *ML2Rule::fromFile(const String &path) {
   // clean up
   cfg.end();
 
+  // a scene applies its states in place and cannot go through outputChannel
+  if (rule->deferred)
+  {
+    for (int i = 0; i < ButtonEvent::EventsCount; i++)
+    {
+      if (rule->eventAction((ButtonEvent::Type)i).action != OutputAction::Scene)
+        continue;
+
+      Serialprint("Scene action of deferred rule %s dropped\r\n", path.c_str());
+      rule->unsetAction((ButtonEvent::Type)i);
+    }
+  }
+
   return rule;
 }
 
@@ -0,0 +1,630 @@
+#include "ml2classes.h"
+
+extern InputList inputList;
+extern OutputList outputList;
+extern SceneList sceneList;
+
+RuleTable::RuleTable()
+  : m_actions(0)
+  , m_cntActions(0)
+  , m_maxActions(0)
+  , m_outputs(0)
+  , m_cntOutputs(0)
+  , m_maxOutputs(0)
+  , m_groups(0)
+  , m_cntGroups(0)
+  , m_maxGroups(0)
+  , m_code(0)
+  , m_cntCode(0)
+  , m_maxCode(0)
+  , m_slots(0)
+  , m_inputStart(0)
+  , m_eventMask(0)
+  , m_cntInputs(0)
+  , m_depSlots(0)
+  , m_depStart(0)
+  , m_changed(0)
+  , m_anyChanged(false)
+  , m_cntDepOutputs(0)
+  , m_cntRules(0)
+{
+#ifdef PROFILE_RULES
+  m_ruleProfile = 0;
+  m_maxRules = 0;
+  resetProfile();
+#endif
+}
+
+RuleTable::~RuleTable()
+{
+  clear();
+}
+
+void RuleTable::clear()
+{
+  delete[] m_actions;
+  delete[] m_outputs;
+  delete[] m_groups;
+  delete[] m_code;
+  delete[] m_slots;
+  delete[] m_inputStart;
+  delete[] m_eventMask;
+  delete[] m_depSlots;
+  delete[] m_depStart;
+  delete[] m_changed;
+
+  m_actions = 0;
+  m_outputs = 0;
+  m_groups = 0;
+  m_code = 0;
+  m_slots = 0;
+  m_inputStart = 0;
+  m_eventMask = 0;
+  m_depSlots = 0;
+  m_depStart = 0;
+  m_changed = 0;
+
+  m_cntActions = m_maxActions = 0;
+  m_cntOutputs = m_maxOutputs = 0;
+  m_cntGroups = m_maxGroups = 0;
+  m_cntCode = m_maxCode = 0;
+  m_cntInputs = 0;
+  m_cntDepOutputs = 0;
+  m_anyChanged = false;
+  m_cntRules = 0;
+
+#ifdef PROFILE_RULES
+  delete[] m_ruleProfile;
+  m_ruleProfile = 0;
+  m_maxRules = 0;
+  resetProfile();
+#endif
+}
+
+#ifdef PROFILE_RULES
+void RuleTable::resetProfile()
+{
+  memset(&m_eventProfile, 0, sizeof(m_eventProfile));
+  if (m_ruleProfile)
+    memset(m_ruleProfile, 0, m_maxRules * sizeof(RuleProfile));
+}
+#endif
+
+void RuleTable::begin()
+{
+  clear();
+
+  // slots are indexed by ML2Input::index and ML2Output::index, the
+  // position of the input or output in its list
+  m_cntInputs = inputList.size();
+  m_cntDepOutputs = outputList.size();
+
+  m_inputStart = new uint16_t[m_cntInputs + 1];
+  m_eventMask = new uint16_t[m_cntInputs];
+  memset(m_inputStart, 0, (m_cntInputs + 1) * sizeof(uint16_t));
+  memset(m_eventMask, 0, m_cntInputs * sizeof(uint16_t));
+
+  m_depStart = new uint16_t[m_cntDepOutputs + 1];
+  m_changed = new byte[(m_cntDepOutputs + 7) / 8];
+  memset(m_depStart, 0, (m_cntDepOutputs + 1) * sizeof(uint16_t));
+  memset(m_changed, 0, (m_cntDepOutputs + 7) / 8);
+}
+
+// Returns the size of the compiled condition or EVAL_FAILURE for actions
+// that can never fire. The count pass sets report, so that a dropped
+// action is reported once.
+int RuleTable::conditionSize(ML2Rule *rule, int event, bool report)
+{
+  ML2Rule::EventAction &ea = rule->eventAction((ButtonEvent::Type)event);
+
+  // a scene that could not be resolved is as good as a broken condition
+  if (ea.action == OutputAction::Scene && (ea.param < 0 || ea.param >= (int)sceneList.size()))
+    return EVAL_FAILURE;
+
+  if (!ea.condition.length())
+    return event == ButtonEvent::OutputChanged ? EVAL_FAILURE : 0;
+
+  int size = compileRuleExpr(ea.condition, 0, 0xFF + EXPR_HEADER_SIZE);
+  if (event != ButtonEvent::OutputChanged || size == EVAL_FAILURE)
+    return size;
+
+  // the action would miss changes of the outputs past the limit
+  byte code[size];
+  byte outputs[RULE_MAX_DEPENDENCIES];
+  compileRuleExpr(ea.condition, code, size);
+  if (ruleExprOutputs(code, outputs, RULE_MAX_DEPENDENCIES) < 0)
+  {
+    if (report)
+      Serialprint("Rule %s reads more than %d outputs, output action dropped\r\n", rule->ID.c_str(), RULE_MAX_DEPENDENCIES);
+    return EVAL_FAILURE;
+  }
+  return size;
+}
+
+int RuleTable::dependencies(const byte *code, byte *outputs)
+{
+  int n = ruleExprOutputs(code, outputs, RULE_MAX_DEPENDENCIES);
+  for (int i = 0; i < n; i++)
+  {
+    if (outputs[i] >= m_cntDepOutputs)
+      outputs[i--] = outputs[--n];
+  }
+  return n;
+}
+
+void RuleTable::count(ML2Rule *rule)
+{
+#ifdef PROFILE_RULES
+  m_maxRules++;
+#endif
+
+  for (int i = 0; i < ButtonEvent::EventsCount; i++)
+  {
+    ML2Rule::EventAction &ea = rule->eventAction((ButtonEvent::Type)i);
+    if (ea.action == OutputAction::Unassigned)
+      continue;
+
+    int codeSize = conditionSize(rule, i, true);
+    if (codeSize == EVAL_FAILURE)
+      continue;
+
+    m_maxActions++;
+    m_maxCode += codeSize;
+    if (ea.action != OutputAction::Scene)
+    {
+      byte cntOutputs, cntGroups;
+      resolveTargets(rule, 0, cntOutputs, 0, cntGroups);
+      m_maxOutputs += cntOutputs;
+      m_maxGroups += cntGroups;
+    }
+
+    // number of slots per input or output is collected one entry ahead, see allocateSlots()
+    if (i == ButtonEvent::OutputChanged)
+    {
+      byte code[codeSize];
+      byte deps[RULE_MAX_DEPENDENCIES];
+      compileRuleExpr(ea.condition, code, codeSize);
+      int cntDeps = dependencies(code, deps);
+      for (int d = 0; d < cntDeps; d++)
+        m_depStart[deps[d] + 1]++;
+      continue;
+    }
+
+    for (InputList::iterator itr = rule->inputs()->begin(); itr != rule->inputs()->end(); ++itr)
+      m_inputStart[(*itr)->index + 1]++;
+  }
+}
+
+// Turns the slot counts into start offsets shifted by one entry, so that
+// start[i + 1] serves as the fill cursor of entry i in add() and ends up as
+// the start of entry i + 1. Returns the number of slots.
+uint16_t RuleTable::allocateSlots(uint16_t *start, byte cnt)
+{
+  uint16_t cntSlots = 0;
+  for (int i = 0; i < cnt; i++)
+  {
+    uint16_t n = start[i + 1];
+    start[i + 1] = cntSlots;
+    cntSlots += n;
+  }
+  return cntSlots;
+}
+
+bool RuleTable::allocate()
+{
+  uint16_t cntSlots = allocateSlots(m_inputStart, m_cntInputs);
+  uint16_t cntDepSlots = allocateSlots(m_depStart, m_cntDepOutputs);
+
+  if (m_maxActions)
+    m_actions = new RuleAction[m_maxActions];
+  if (m_maxOutputs)
+    m_outputs = new ML2Output*[m_maxOutputs];
+  if (m_maxGroups)
+    m_groups = new ML2Group*[m_maxGroups];
+  if (m_maxCode)
+    m_code = new byte[m_maxCode];
+  if (cntSlots)
+    m_slots = new uint16_t[cntSlots];
+  if (cntDepSlots)
+    m_depSlots = new uint16_t[cntDepSlots];
+
+#ifdef PROFILE_RULES
+  // the table works without the profile
+  if (m_maxRules)
+    m_ruleProfile = new RuleProfile[m_maxRules];
+  resetProfile();
+#endif
+
+  return (m_actions || !m_maxActions) && (m_outputs || !m_maxOutputs) &&
+         (m_groups || !m_maxGroups) && (m_code || !m_maxCode) &&
+         (m_slots || !cntSlots) && (m_depSlots || !cntDepSlots);
+}
+
+#define TARGET_SEEN(out) (seen[(out)->index >> 3] & _BV((out)->index & 7))
+#define TARGET_MARK(out) (seen[(out)->index >> 3] |= _BV((out)->index & 7))
+
+// Splits the targets of a rule so that no output is acted on twice: groups
+// sharing no output with an earlier group are applied as a whole, everything
+// else output by output. Fills outputs and groups if given.
+void RuleTable::resolveTargets(ML2Rule *rule, ML2Output **outputs, byte &cntOutputs, ML2Group **groups, byte &cntGroups)
+{
+  byte seen[(m_cntDepOutputs + 7) / 8];
+  memset(seen, 0, sizeof(seen));
+  cntOutputs = cntGroups = 0;
+
+  for (GroupList::iterator g = rule->groups()->begin(); g != rule->groups()->end(); ++g)
+  {
+    OutputList *members = (*g)->outputs();
+    OutputList::iterator itr = members->begin();
+    while (itr != members->end() && !TARGET_SEEN(*itr))
+      ++itr;
+    if (itr != members->end())
+      continue;
+
+    for (itr = members->begin(); itr != members->end(); ++itr)
+      TARGET_MARK(*itr);
+    if (groups)
+      groups[cntGroups] = (*g);
+    cntGroups++;
+  }
+
+  // the rule's own outputs, then the members of the overlapping groups
+  for (OutputList::iterator itr = rule->outputs()->begin(); itr != rule->outputs()->end(); ++itr)
+  {
+    if (TARGET_SEEN(*itr))
+      continue;
+    TARGET_MARK(*itr);
+    if (outputs)
+      outputs[cntOutputs] = (*itr);
+    cntOutputs++;
+  }
+
+  for (GroupList::iterator g = rule->groups()->begin(); g != rule->groups()->end(); ++g)
+  {
+    for (OutputList::iterator itr = (*g)->outputs()->begin(); itr != (*g)->outputs()->end(); ++itr)
+    {
+      if (TARGET_SEEN(*itr))
+        continue;
+      TARGET_MARK(*itr);
+      if (outputs)
+        outputs[cntOutputs] = (*itr);
+      cntOutputs++;
+    }
+  }
+}
+
+#undef TARGET_SEEN
+#undef TARGET_MARK
+
+void RuleTable::add(ML2Rule *rule)
+{
+  uint16_t ruleIndex = m_cntRules++;
+
+  for (int i = 0; i < ButtonEvent::EventsCount; i++)
+  {
+    ML2Rule::EventAction &ea = rule->eventAction((ButtonEvent::Type)i);
+    if (ea.action == OutputAction::Unassigned)
+      continue;
+
+    int codeSize = conditionSize(rule, i, false);
+    if (codeSize == EVAL_FAILURE)
+      continue;
+
+    bool scene = (ea.action == OutputAction::Scene);
+    byte cntOutputs = 0;
+    byte cntGroups = 0;
+    if (!scene)
+      resolveTargets(rule, 0, cntOutputs, 0, cntGroups);
+
+    if (m_cntActions >= m_maxActions || m_cntOutputs + cntOutputs > m_maxOutputs ||
+        m_cntGroups + cntGroups > m_maxGroups || m_cntCode + codeSize > m_maxCode)
+      return;
+
+    RuleAction &ra = m_actions[m_cntActions];
+    ra.event = i;
+    ra.action = ea.action;
+    ra.flags = rule->final ? RULE_ACTION_FINAL : 0;
+    if (rule->deferred)
+      ra.flags |= RULE_ACTION_DEFERRED;
+    ra.priority = rule->priority;
+    ra.param = ea.param;
+    ra.timeout = ea.timeout;
+    ra.rule = ruleIndex;
+
+    ra.code = RULE_NO_CODE;
+    if (codeSize)
+    {
+      ra.code = m_cntCode;
+      m_cntCode += compileRuleExpr(ea.condition, m_code + ra.code, codeSize);
+    }
+
+    ra.firstOutput = m_cntOutputs;
+    ra.cntOutputs = cntOutputs;
+    ra.firstGroup = m_cntGroups;
+    ra.cntGroups = cntGroups;
+    if (!scene)
+    {
+      resolveTargets(rule, m_outputs + m_cntOutputs, cntOutputs, m_groups + m_cntGroups, cntGroups);
+      m_cntOutputs += cntOutputs;
+      m_cntGroups += cntGroups;
+    }
+
+    if (i == ButtonEvent::OutputChanged)
+    {
+      byte deps[RULE_MAX_DEPENDENCIES];
+      int cntDeps = dependencies(m_code + ra.code, deps);
+      for (int d = 0; d < cntDeps; d++)
+        m_depSlots[m_depStart[deps[d] + 1]++] = m_cntActions;
+    }
+    else
+    {
+      for (InputList::iterator itr = rule->inputs()->begin(); itr != rule->inputs()->end(); ++itr)
+      {
+        byte in = (*itr)->index;
+        m_slots[m_inputStart[in + 1]++] = m_cntActions;
+        m_eventMask[in] |= _BV(i);
+      }
+    }
+
+    m_cntActions++;
+  }
+}
+
+bool RuleTable::runsBefore(uint16_t a, uint16_t b)
+{
+  if (m_actions[a].event != m_actions[b].event)
+    return m_actions[a].event < m_actions[b].event;
+  if (m_actions[a].priority != m_actions[b].priority)
+    return m_actions[a].priority > m_actions[b].priority;
+  // rules are loaded sorted by ID
+  return m_actions[a].rule < m_actions[b].rule;
+}
+
+// Sorts the slots of every entry by event, priority and rule. Returns the
+// number of slots left.
+uint16_t RuleTable::sortSlots(uint16_t *slots, uint16_t *start, byte cnt)
+{
+  uint16_t cntSlots = 0;
+
+  for (int e = 0; e < cnt; e++)
+  {
+    uint16_t first = start[e];
+    uint16_t last = start[e + 1];
+
+    for (uint16_t i = first + 1; i < last; i++)
+    {
+      uint16_t s = slots[i];
+      uint16_t j = i;
+      while (j > first && runsBefore(s, slots[j - 1]))
+      {
+        slots[j] = slots[j - 1];
+        j--;
+      }
+      slots[j] = s;
+    }
+
+    // Nothing after a final action without a condition can ever run, so
+    // the slots of the same event behind it are dropped
+    start[e] = cntSlots;
+    int cutEvent = -1;
+    for (uint16_t i = first; i < last; i++)
+    {
+      RuleAction &ra = m_actions[slots[i]];
+      if (ra.event == cutEvent)
+        continue;
+
+      slots[cntSlots++] = slots[i];
+      if ((ra.flags & RULE_ACTION_FINAL) && ra.code == RULE_NO_CODE)
+        cutEvent = ra.event;
+    }
+  }
+
+  start[cnt] = cntSlots;
+  return cntSlots;
+}
+
+// Returns the i-th output an action writes to, or 0 past the last one
+ML2Output *RuleTable::target(RuleAction &ra, byte i)
+{
+  if (ra.action == OutputAction::Scene)
+  {
+    OutputList *outputs = sceneList.at(ra.param)->group->outputs();
+    return i < outputs->size() ? outputs->at(i) : 0;
+  }
+
+  if (i < ra.cntOutputs)
+    return m_outputs[ra.firstOutput + i];
+  i -= ra.cntOutputs;
+
+  for (byte g = 0; g < ra.cntGroups; g++)
+  {
+    OutputList *outputs = m_groups[ra.firstGroup + g]->outputs();
+    if (i < outputs->size())
+      return outputs->at(i);
+    i -= outputs->size();
+  }
+  return 0;
+}
+
+#define CYCLE_UNVISITED 0
+#define CYCLE_ON_PATH   1
+#define CYCLE_DONE      2
+
+// Depth first walk of the output graph: an edge leads from an output to the
+// targets of every action depending on it. An action leading back to an
+// output on the current path closes a cycle and is disabled.
+void RuleTable::checkCycles(byte out, byte *state)
+{
+  state[out] = CYCLE_ON_PATH;
+
+  for (uint16_t s = m_depStart[out]; s < m_depStart[out + 1]; s++)
+  {
+    RuleAction &ra = m_actions[m_depSlots[s]];
+    if (ra.flags & RULE_ACTION_DISABLED)
+      continue;
+
+    ML2Output *t;
+    for (byte i = 0; (t = target(ra, i)); i++)
+    {
+      if (state[t->index] == CYCLE_ON_PATH)
+      {
+        ra.flags |= RULE_ACTION_DISABLED;
+        Serialprint("Rule cycle through output %s, action disabled\r\n", t->ID);
+        break;
+      }
+      if (state[t->index] == CYCLE_UNVISITED)
+        checkCycles(t->index, state);
+    }
+  }
+
+  state[out] = CYCLE_DONE;
+}
+
+void RuleTable::end()
+{
+  sortSlots(m_slots, m_inputStart, m_cntInputs);
+  sortSlots(m_depSlots, m_depStart, m_cntDepOutputs);
+
+  byte state[m_cntDepOutputs];
+  memset(state, CYCLE_UNVISITED, m_cntDepOutputs);
+  for (byte out = 0; out < m_cntDepOutputs; out++)
+  {
+    if (state[out] == CYCLE_UNVISITED)
+      checkCycles(out, state);
+  }
+}
+
+bool RuleTable::matches(RuleAction &ra)
+{
+#ifdef PROFILE_RULES
+  if (!m_ruleProfile)
+    return ra.code == RULE_NO_CODE || runRuleExpr(m_code + ra.code);
+
+  RuleProfile &prof = m_ruleProfile[ra.rule];
+  bool match = true;
+  if (ra.code != RULE_NO_CODE)
+  {
+    uint32_t start = micros();
+    match = runRuleExpr(m_code + ra.code);
+    prof.condition.add(micros() - start);
+  }
+  match ? prof.matched++ : prof.missed++;
+  return match;
+#else
+  return ra.code == RULE_NO_CODE || runRuleExpr(m_code + ra.code);
+#endif
+}
+
+void RuleTable::apply(RuleAction &ra)
+{
+#ifdef PROFILE_RULES
+  if (m_ruleProfile)
+    m_ruleProfile[ra.rule].actions += ra.action == OutputAction::Scene ? 1 : ra.cntOutputs + ra.cntGroups;
+#endif
+
+  if (ra.action == OutputAction::Scene)
+  {
+    sceneList.at(ra.param)->apply();
+    return;
+  }
+
+  ML2Output **output = m_outputs + ra.firstOutput;
+  for (byte i = 0; i < ra.cntOutputs; i++, output++)
+  {
+    if (ra.flags & RULE_ACTION_DEFERRED)
+    {
+      sendOutputCommand(OutputCommand((*output)->index, ra.action, ra.param, ra.timeout));
+      continue;
+    }
+
+    (*output)->action((OutputAction::Action)ra.action, ra.param, ra.timeout);
+    printOutputAction((*output), ra.action, ra.param);
+  }
+
+  ML2Group **group = m_groups + ra.firstGroup;
+  for (byte i = 0; i < ra.cntGroups; i++, group++)
+  {
+    if (ra.flags & RULE_ACTION_DEFERRED)
+    {
+      for (OutputList::iterator itr = (*group)->outputs()->begin(); itr != (*group)->outputs()->end(); ++itr)
+        sendOutputCommand(OutputCommand((*itr)->index, ra.action, ra.param, ra.timeout));
+      continue;
+    }
+
+    (*group)->action((OutputAction::Action)ra.action, ra.param, ra.timeout);
+  }
+}
+
+bool RuleTable::dispatch(uint16_t *slots, uint16_t first, uint16_t last, int event)
+{
+#ifdef PROFILE_RULES
+  uint32_t start = micros();
+#endif
+
+  // All conditions see the outputs as they were before the event, so the
+  // matching actions are collected first and applied afterwards.
+  uint16_t matched[last - first];
+  uint16_t cntMatched = 0;
+
+  for (uint16_t i = first; i < last; i++)
+  {
+    RuleAction &ra = m_actions[slots[i]];
+    if (ra.event < event)
+      continue;
+    if (ra.event > event)
+      break;
+
+    if (!(ra.flags & RULE_ACTION_DISABLED) && matches(ra))
+    {
+      matched[cntMatched++] = slots[i];
+      if (ra.flags & RULE_ACTION_FINAL)
+        break;
+    }
+  }
+
+  for (uint16_t i = 0; i < cntMatched; i++)
+    apply(m_actions[matched[i]]);
+
+#ifdef PROFILE_RULES
+  m_eventProfile.add(micros() - start);
+#endif
+
+  return cntMatched;
+}
+
+bool RuleTable::processButtonEvent(int event, ML2Input *input)
+{
+  byte in = input->index;
+  if (in >= m_cntInputs || !(m_eventMask[in] & _BV(event)))
+    return false;
+
+  return dispatch(m_slots, m_inputStart[in], m_inputStart[in + 1], event);
+}
+
+void RuleTable::outputChanged(ML2Output *output)
+{
+  byte out = output->index;
+  if (out >= m_cntDepOutputs || m_depStart[out] == m_depStart[out + 1])
+    return;
+
+  m_changed[out >> 3] |= _BV(out & 7);
+  m_anyChanged = true;
+}
+
+void RuleTable::processOutputChanges()
+{
+  // Applied actions may change further outputs. The dependency graph has no
+  // cycles, so this ends.
+  while (m_anyChanged)
+  {
+    m_anyChanged = false;
+    for (byte out = 0; out < m_cntDepOutputs; out++)
+    {
+      if (!(m_changed[out >> 3] & _BV(out & 7)))
+        continue;
+
+      m_changed[out >> 3] &= ~_BV(out & 7);
+      dispatch(m_depSlots, m_depStart[out], m_depStart[out + 1], ButtonEvent::OutputChanged);
+    }
+  }
+}
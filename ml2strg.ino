@@ -1,6 +1,6 @@
 #include <avr/eeprom.h>
 
-#define CONFIG_VERSION "ML2"
+#define CONFIG_VERSION "ML4"
 #define CONFIG_START 0
 
 // Input flags
@@ -10,6 +10,8 @@
 #define ML2I_FLAG_PULLUP       ( ML2I_FLAG_INTUP | ML2I_FLAG_EXTDOWN | ML2I_FLAG_EXTUP )
 #define ML2I_FLAG_REPEAT       0x04
 #define ML2I_FLAG_PREVENTCLICK 0x08
+#define ML2I_FLAG_TRIPLECLICK  0x10
+#define ML2I_FLAG_CLICKHOLD    0x20
 
 // Output flags
 #define ML2O_FLAG_ON           0x01
@@ -23,6 +25,7 @@
 
 // Rules flags
 #define ML2R_FLAG_FINAL        0x01
+#define ML2R_FLAG_DEFERRED     0x02
 
 
 struct ML2StorageConfig {
@@ -41,6 +44,9 @@ struct ML2StorageHeader {
   int addrOutputs;
   byte cntOutputs;
 
+  int addrGroups;
+  byte cntGroups;
+
   int addrRules;
   byte cntRules;
 } storageHeader;
@@ -62,10 +68,22 @@ struct ML2StoreOutput {
   byte szID;
 } storageOutput;
 
+struct ML2StoreGroup {
+  byte cntOutputs;
+  byte cntScenes;
+  byte szID;
+} storageGroup;
+
+struct ML2StoreScene {
+  byte szID;
+} storageScene;
+
 struct ML2StoreRule {
   byte flags;
+  int8_t priority;
   byte cntInputs;
   byte cntOutputs;
+  byte cntGroups;
   byte cntEventActions;
   byte szID;
 } storageRule;
@@ -175,6 +193,8 @@ int loadInputEEPROM(ML2Input *input, int addr) {
   }
   input->setRepeat(storageInput.flags & ML2I_FLAG_REPEAT);
   input->setPreventClick(storageInput.flags & ML2I_FLAG_PREVENTCLICK);
+  input->setGestures(((storageInput.flags & ML2I_FLAG_TRIPLECLICK) ? InputGesture::TripleClick : 0) |
+                     ((storageInput.flags & ML2I_FLAG_CLICKHOLD) ? InputGesture::ClickHold : 0));
   input->setBounceInterval(storageInput.bi);
   input->setHoldInterval(storageInput.hi);
   input->setRepeatInterval(storageInput.ri);
@@ -207,6 +227,10 @@ int saveInputEEPROM(ML2Input *input, int addr) {
     storageInput.flags |= ML2I_FLAG_REPEAT;
   if (input->preventClick())
     storageInput.flags |= ML2I_FLAG_PREVENTCLICK;
+  if (input->gestures() & InputGesture::TripleClick)
+    storageInput.flags |= ML2I_FLAG_TRIPLECLICK;
+  if (input->gestures() & InputGesture::ClickHold)
+    storageInput.flags |= ML2I_FLAG_CLICKHOLD;
 
   storageInput.bi = input->bounceInterval();
   storageInput.hi = input->holdInterval();
@@ -304,7 +328,92 @@ int saveOutputEEPROM(ML2Output *output, int addr) {
   return sz;
 }
 
-int loadRuleEEPROM(ML2Rule *rule, int addr, bool regInputs) {
+int loadGroupEEPROM(ML2Group *group, int addr) {
+  eeprom_read_block((void*)&storageGroup, (const void*)addr, sizeof(storageGroup));
+
+  int sz = sizeof(storageGroup);
+  memset(group->ID, 0, ID_SIZE);
+  if (storageGroup.szID) {
+    eeprom_read_block((void*)&group->ID, (const void*)(addr + sz), storageGroup.szID);
+    sz += storageGroup.szID;
+  }
+
+  for (int i = 0; i < storageGroup.cntOutputs; i++) {
+    byte pos;
+    eeprom_read_block((void*)&pos, (const void*)(addr + sz), sizeof(pos));
+    group->outputs()->addOutput(outputList.at(pos));
+    sz += sizeof(pos);
+  }
+
+  // scenes are skipped rather than misread if the group could not be restored
+  int dataSize = 2 * ((storageGroup.cntOutputs + 7) / 8) + storageGroup.cntOutputs;
+  for (int i = 0; i < storageGroup.cntScenes; i++) {
+    eeprom_read_block((void*)&storageScene, (const void*)(addr + sz), sizeof(storageScene));
+    sz += sizeof(storageScene);
+
+    char id[storageScene.szID + 1];
+    eeprom_read_block((void*)&id, (const void*)(addr + sz), storageScene.szID);
+    id[storageScene.szID] = 0;
+    sz += storageScene.szID;
+
+    ML2Scene *scene = new ML2Scene(id, group);
+    if (scene->dataSize() == dataSize)
+      eeprom_read_block((void*)scene->data(), (const void*)(addr + sz), dataSize);
+    sz += dataSize;
+
+    if (scene->dataSize() != dataSize || !sceneList.addScene(scene))
+      delete scene;
+  }
+
+  return sz;
+}
+
+int saveGroupEEPROM(ML2Group *group, int addr) {
+  int sz = sizeof(storageGroup);
+
+  storageGroup.szID = strlen(group->ID);
+  if (storageGroup.szID) {
+    eeprom_update_block((const void*)group->ID, (void*)(addr + sz), storageGroup.szID);
+    sz += storageGroup.szID;
+  }
+
+  storageGroup.cntOutputs = 0;
+  for (OutputList::iterator itr = group->outputs()->begin(); itr != group->outputs()->end(); ++itr) {
+    int8_t pos = outputList.indexOf((*itr));
+    if (pos == -1)
+      continue;
+
+    eeprom_update_block((const void*)&pos, (void*)(addr + sz), sizeof(pos));
+    storageGroup.cntOutputs++;
+    sz += sizeof(pos);
+  }
+
+  storageGroup.cntScenes = 0;
+  for (SceneList::iterator itr = sceneList.begin(); itr != sceneList.end(); ++itr) {
+    ML2Scene *scene = (*itr);
+    if (scene->group != group)
+      continue;
+
+    storageScene.szID = strlen(scene->ID);
+    eeprom_update_block((const void*)&storageScene, (void*)(addr + sz), sizeof(storageScene));
+    sz += sizeof(storageScene);
+
+    eeprom_update_block((const void*)scene->ID, (void*)(addr + sz), storageScene.szID);
+    sz += storageScene.szID;
+
+    eeprom_update_block((const void*)scene->data(), (void*)(addr + sz), scene->dataSize());
+    sz += scene->dataSize();
+
+    storageGroup.cntScenes++;
+  }
+
+  eeprom_update_block((const void*)&storageGroup, (void*)addr, sizeof(storageGroup));
+
+  Serialprint("Saved group %s at %d (%d bytes)\r\n", group->ID, addr, sz);
+  return sz;
+}
+
+int loadRuleEEPROM(ML2Rule *rule, int addr) {
   eeprom_read_block((void*)&storageRule, (const void*)addr, sizeof(storageRule));
 
   int sz = sizeof(storageRule);
@@ -318,23 +427,27 @@ int loadRuleEEPROM(ML2Rule *rule, int addr, bool regInputs) {
   }
 
   rule->final = storageRule.flags & ML2R_FLAG_FINAL;
+  rule->deferred = storageRule.flags & ML2R_FLAG_DEFERRED;
+  rule->priority = storageRule.priority;
 
   for (int i = 0; i < storageRule.cntInputs; i++) {
     byte pos;
     eeprom_read_block((void*)&pos, (const void*)(addr + sz), sizeof(pos));
-    ML2Input *input = inputList.at(pos);
-    if (regInputs) {
-      inputList.addInputRule(input->ID, addr);
-      rule->addInput(input->ID);
-    }
+    rule->inputs()->addInput(inputList.at(pos));
     sz += sizeof(pos);
   }
 
   for (int i = 0; i < storageRule.cntOutputs; i++) {
     byte pos;
     eeprom_read_block((void*)&pos, (const void*)(addr + sz), sizeof(pos));
-    ML2Output *output = outputList.at(pos);
-    rule->addOutput(output->ID);
+    rule->outputs()->addOutput(outputList.at(pos));
+    sz += sizeof(pos);
+  }
+
+  for (int i = 0; i < storageRule.cntGroups; i++) {
+    byte pos;
+    eeprom_read_block((void*)&pos, (const void*)(addr + sz), sizeof(pos));
+    rule->groups()->addGroup(groupList.at(pos));
     sz += sizeof(pos);
   }
 
@@ -344,7 +457,7 @@ int loadRuleEEPROM(ML2Rule *rule, int addr, bool regInputs) {
     sz += sizeof(storageEventAction);
 
     if (storageEventAction.szCondition) {
-      char cond[storageEventAction.szCondition];
+      char cond[storageEventAction.szCondition + 1];
       memset(cond, 0, sizeof(cond));
       eeprom_read_block((void*)&cond, (const void*)(addr + sz), storageEventAction.szCondition);
       cond[storageEventAction.szCondition] = 0;
@@ -367,6 +480,9 @@ int saveRuleEEPROM(ML2Rule *rule, int addr) {
   storageRule.flags = 0;
   if (rule->final)
     storageRule.flags |= ML2R_FLAG_FINAL;
+  if (rule->deferred)
+    storageRule.flags |= ML2R_FLAG_DEFERRED;
+  storageRule.priority = rule->priority;
 
   storageRule.cntInputs = 0;
   for (InputList::iterator itr = rule->inputs()->begin(); itr != rule->inputs()->end(); ++itr) {
@@ -376,8 +492,6 @@ int saveRuleEEPROM(ML2Rule *rule, int addr) {
 
     eeprom_update_block((const void*)&pos, (void*)(addr + sz), sizeof(pos));
 
-    inputList.addInputRule((*itr)->ID, addr);
-
     storageRule.cntInputs++;
     sz += sizeof(pos);
   }
@@ -393,6 +507,17 @@ int saveRuleEEPROM(ML2Rule *rule, int addr) {
     sz += sizeof(pos);
   }
 
+  storageRule.cntGroups = 0;
+  for (GroupList::iterator itr = rule->groups()->begin(); itr != rule->groups()->end(); ++itr) {
+    int8_t pos = groupList.indexOf((*itr));
+    if (pos == -1)
+      continue;
+
+    eeprom_update_block((const void*)&pos, (void*)(addr + sz), sizeof(pos));
+    storageRule.cntGroups++;
+    sz += sizeof(pos);
+  }
+
   storageRule.cntEventActions = 0;
   for (int i = 0; i < ButtonEvent::EventsCount; i++)
   {
@@ -99,11 +99,22 @@ void stateCmd(WebServer &server, WebServer::ConnectionType type, char *url_tail,
     }
 
     if (state >= 0 )
-      outputEM.queueEvent(OutputAction::Value, new OutputEventParam(output, state, timeout));
+      sendOutputCommand(OutputCommand(output->index, OutputAction::Value, state, timeout));
     if (inc != 0 )
-      outputEM.queueEvent(OutputAction::IncValue, new OutputEventParam(output, inc, timeout));
+      sendOutputCommand(OutputCommand(output->index, OutputAction::IncValue, inc, timeout));
     if (on >= 0 )
-      outputEM.queueEvent(on ? OutputAction::On : OutputAction::Off, new OutputEventParam(output, on, timeout));
+      sendOutputCommand(OutputCommand(output->index, on ? OutputAction::On : OutputAction::Off, on, timeout));
+  }
+  else if (strcmp(c, "scene") == 0)
+  {
+    ML2Scene *scene = sceneList.find(id);
+    if (!scene)
+    {
+      server.httpNoContent();
+      return;
+    }
+
+    scene->apply();
   }
   else if (strcmp(c, "button") == 0)
   {
@@ -118,6 +129,160 @@ void stateCmd(WebServer &server, WebServer::ConnectionType type, char *url_tail,
   }
 }
 
+#ifdef PROFILE_RULES
+void printProfileTime(WebServer &server, const ProfileTime &t)
+{
+  server.print(t.minTime);
+  server.print(";");
+  server.print(t.count ? t.totalTime / t.count : 0);
+  server.print(";");
+  server.print(t.maxTime);
+}
+#endif
+
+// Lists rule counters and timings as
+// "events;count;min;avg;max" followed by
+// "ID;matched;missed;actions;conditions;min;avg;max" per rule,
+// "r=1" resets them after listing
+void profCmd(WebServer &server, WebServer::ConnectionType type, char *url_tail, bool tail_complete)
+{
+#ifdef PROFILE_RULES
+  server.httpSuccess("text/plain");
+
+  if (type != WebServer::GET)
+  {
+    if (type != WebServer::HEAD)
+      server.httpFail();
+    return;
+  }
+
+  URLPARAM_RESULT rc;
+  char name[NAMELEN];
+  char value[VALUELEN];
+  bool reset = false;
+
+  while (strlen(url_tail))
+  {
+    rc = server.nextURLparam(&url_tail, name, NAMELEN, value, VALUELEN);
+    if (rc == URLPARAM_OK && name[0] == 'r')
+      reset = atoi(value);
+  }
+
+  const ProfileTime &events = ruleTable.eventProfile();
+  server.print("events;");
+  server.print(events.count);
+  server.print(";");
+  printProfileTime(server, events);
+  server.print("\r\n");
+
+  // rule IDs are not kept in RAM, so walk the stored rules in table order
+  int addr = storageHeader.addrRules;
+  for (int i = 0; i < storageHeader.cntRules && i < ruleTable.profiledRules(); i++)
+  {
+    ML2Rule *rule = new ML2Rule("");
+    addr += loadRuleEEPROM(rule, addr);
+
+    const RuleProfile &prof = ruleTable.ruleProfile(i);
+    server.print(rule->ID.c_str());
+    server.print(";");
+    server.print(prof.matched);
+    server.print(";");
+    server.print(prof.missed);
+    server.print(";");
+    server.print(prof.actions);
+    server.print(";");
+    server.print(prof.condition.count);
+    server.print(";");
+    printProfileTime(server, prof.condition);
+    server.print("\r\n");
+
+    delete rule;
+  }
+
+  if (reset)
+    ruleTable.resetProfile();
+#else
+  server.httpFail();
+#endif
+}
+
+void printQueueStats(WebServer &server, const char *name, const EventManager::QueueStats &stats)
+{
+  server.print(name);
+  server.print(";");
+  server.print(stats.size);
+  server.print(";");
+  server.print(stats.timerSize);
+  server.print(";");
+  server.print(stats.depth);
+  server.print(";");
+  server.print(stats.highWater);
+  server.print(";");
+  server.print(stats.enqueued);
+  server.print(";");
+  server.print(stats.dropped);
+  server.print(";");
+  server.print(stats.coalesced);
+  server.print(";");
+  server.print(stats.dispatched);
+  server.print(";");
+  server.print(stats.maxDwell);
+  server.print(";");
+  server.print(stats.dispatched ? stats.totalDwell / stats.dispatched : 0);
+  server.print("\r\n");
+}
+
+void printQueueStats(WebServer &server, const char *name, EventManager &em)
+{
+  EventManager::QueueStats stats;
+  em.getQueueStats(&stats);
+  printQueueStats(server, name, stats);
+}
+
+// Lists event queue counters as
+// "name;size;timers;depth;high;enqueued;dropped;coalesced;dispatched;maxdwell;avgdwell",
+// dwell times in ms, "r=1" resets them after listing
+void queuesCmd(WebServer &server, WebServer::ConnectionType type, char *url_tail, bool tail_complete)
+{
+  server.httpSuccess("text/plain");
+
+  if (type != WebServer::GET)
+  {
+    if (type != WebServer::HEAD)
+      server.httpFail();
+    return;
+  }
+
+  URLPARAM_RESULT rc;
+  char name[NAMELEN];
+  char value[VALUELEN];
+  bool reset = false;
+
+  while (strlen(url_tail))
+  {
+    rc = server.nextURLparam(&url_tail, name, NAMELEN, value, VALUELEN);
+    if (rc == URLPARAM_OK && name[0] == 'r')
+      reset = atoi(value);
+  }
+
+  EventManager::QueueStats inputStats;
+  EventManager::QueueStats outputStats;
+  inputChannel.getStats(&inputStats);
+  outputChannel.getStats(&outputStats);
+
+  printQueueStats(server, "input", inputStats);
+  printQueueStats(server, "output", outputStats);
+  // externalEM queues all events with low priority
+  printQueueStats(server, "external", externalEM);
+
+  if (reset)
+  {
+    inputChannel.resetStats();
+    outputChannel.resetStats();
+    externalEM.resetQueueStats();
+  }
+}
+
 void setupWeb()
 {
   if (!ip[0] && !ip[1] && !ip[2] && !ip[3])
@@ -135,5 +300,7 @@ void setupWeb()
 
   webserver.setDefaultCommand(&defaultCmd);
   webserver.addCommand("state", &stateCmd);
+  webserver.addCommand("prof", &profCmd);
+  webserver.addCommand("queues", &queuesCmd);
 }
 
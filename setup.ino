@@ -1,20 +1,32 @@
 #include <avr/wdt.h>
 
+// Local input to output work is layered above reporting and web work:
+// runner executes a pass of localRunner before each of its own tasks, and
+// long running low priority work yields to it through serviceLocal().
+Scheduler localRunner;
 Scheduler runner;
 
-Task t1(1, TASK_FOREVER, &buttonLoop, &runner);
-Task t2(1, TASK_FOREVER, &relayLoop, &runner);
+Task t1(1, TASK_FOREVER, &buttonLoop, &localRunner);
+Task t2(1, TASK_FOREVER, &relayLoop, &localRunner);
 Task t3(1, TASK_FOREVER, &externalLoop, &runner);
 Task t4(1, TASK_FOREVER, &webLoop, &runner);
 
+// Reports externalLoop may send per tick, and the time it may start new ones
+// in, in ms. Every report waits for its response, so the budget has to cover
+// those waits or a tick never gets past its first report.
+#define EXTERNAL_TICK_EVENTS 4
+#define EXTERNAL_TICK_BUDGET (EXTERNAL_TICK_EVENTS * EXTERNAL_RESPONSE_WAIT)
+
 void buttonLoop() {
   inputList.check();
-  inputEM.processAllEvents();
+  inputChannel.process();
 }
 
 void relayLoop() {
-  outputEM.processAllEvents();
+  outputChannel.process();
   outputList.check();
+  ruleTable.processOutputChanges();
+  checkParamPools();
 }
 
 #define WBSIZE 1024
@@ -25,9 +37,27 @@ void webLoop()
   webserver.processConnection(webBuffer, &buflen);
 }
 
+// Runs pending input and output work, so that buttons keep reaching
+// their relays while low priority work waits
+void serviceLocal()
+{
+  localRunner.execute();
+}
+
+// Waits for ms while servicing local work
+void serviceLocal(unsigned long ms)
+{
+  unsigned long start = millis();
+  do {
+    serviceLocal();
+  } while (millis() - start < ms);
+}
+
 void externalLoop()
 {
-  externalEM.processEvent();
+  // a report waits for its response through serviceLocal(), so local work
+  // still runs between the reports of a batch
+  externalEM.processEvents(EXTERNAL_TICK_EVENTS, EXTERNAL_TICK_BUDGET * 1000UL);
 }
 
 
@@ -85,12 +115,15 @@ void setupTasks()
   t3.enable();
   t4.enable();
 
+  localRunner.init();
   runner.init();
 
-  runner.addTask(t1);
-  runner.addTask(t2);
+  localRunner.addTask(t1);
+  localRunner.addTask(t2);
   runner.addTask(t3);
   runner.addTask(t4);
+
+  runner.setHighPriorityScheduler(&localRunner);
 }
 
 int setupInputsSD() {
@@ -165,6 +198,18 @@ int setupInputsSD() {
       } else if (cfg.nameIs("prevclick")) {
         b->setPreventClick(cfg.getBooleanValue());
 
+      } else if (cfg.nameIs("tclick")) {
+        if (cfg.getBooleanValue())
+          b->setGestures(b->gestures() | InputGesture::TripleClick);
+        else
+          b->setGestures(b->gestures() & ~InputGesture::TripleClick);
+
+      } else if (cfg.nameIs("clickhold")) {
+        if (cfg.getBooleanValue())
+          b->setGestures(b->gestures() | InputGesture::ClickHold);
+        else
+          b->setGestures(b->gestures() & ~InputGesture::ClickHold);
+
       }
     }
 
@@ -281,9 +326,106 @@ int setupOutputsSD() {
   return sz;
 }
 
+int setupGroupsSD() {
+  const uint8_t CONFIG_LINE_LENGTH = 127;
+
+  String configDir = F(GROUPS_PATH);
+  File dir = SD.open(configDir);
+
+  groupList.clearGroups();
+  sceneList.clearScenes();
+  storageHeader.cntGroups = 0;
+
+  if (!dir.isDirectory())
+    return 0;
 
-int loadRulesFromFile(File &dir, String path) {
   int sz = 0;
+
+  SDConfigFile cfg;
+
+  while (true) {
+    File inp = dir.openNextFile();
+    if (!inp)
+      break;
+
+    if (inp.isDirectory())
+    {
+      inp.close();
+      continue;
+    }
+
+    const char *id = inp.name();
+    inp.close();
+
+    ML2Group *g = new ML2Group(id);
+
+    // The open configuration file.
+    if (!cfg.begin(String(configDir + "/" + String(id)).c_str(), CONFIG_LINE_LENGTH)) {
+      Serialprint("Failed to open group file: %s\r\n", id);
+      delete g;
+      cfg.end();
+      continue;
+    }
+
+    int cntScenes = sceneList.size();
+
+    // Read each setting from the file.
+    while (cfg.readNextSetting()) {
+
+      if (cfg.nameIs("output")) {
+        String outputId = cfg.getValue();
+        outputId.toUpperCase();
+
+        // scenes hold one state per output, so outputs have to come first
+        if (sceneList.size() != cntScenes || !g->outputs()->addOutput(outputList.find(outputId.c_str())))
+          Serialprint("Could not add output %s to group %s\r\n", outputId.c_str(), id);
+
+      } else if (cfg.nameIs("scene")) {
+        // scene=NAME:state,state,...
+        String scene = cfg.getValue();
+        int sep = scene.indexOf(':');
+        String sceneId = scene.substring(0, sep);
+        sceneId.toUpperCase();
+
+        ML2Scene *s = new ML2Scene(sceneId, g);
+        if (sep < 0 || !s->setStates(scene.c_str() + sep + 1) || !sceneList.addScene(s)) {
+          Serialprint("Failed to add scene %s to group %s\r\n", sceneId.c_str(), id);
+          delete s;
+        }
+      }
+    }
+
+    // clean up
+    cfg.end();
+
+    if (!groupList.addGroup(g))
+    {
+      Serialprint("Failed to add group %s\r\n", id);
+      sceneList.removeScenes(g);
+      delete g;
+    }
+    else
+    {
+      Serialprint("Added group %s with %d outputs\r\n", id, g->outputs()->size());
+      sz += saveGroupEEPROM(g, storageHeader.addrGroups + sz);
+      storageHeader.cntGroups++;
+    }
+  }
+
+  dir.close();
+  return sz;
+}
+
+
+inline bool byName(String a, String b) {
+  return a > b;
+}
+
+// FAT directories are unordered, so the rules of a directory are stored
+// sorted by name. Rules of equal priority then run in the same order on
+// every boot.
+int loadRulesFromFile(File &dir, String path, int addr) {
+  SimpleList<String> names;
   while (true) {
 
     File entry =  dir.openNextFile();
@@ -292,9 +434,20 @@ int loadRulesFromFile(File &dir, String path) {
       break;
     }
 
-    String npath = path + String("/") + entry.name();
+    names.push_back(entry.name());
+    entry.close();
+  }
+  names.sort(byName);
+
+  int sz = 0;
+  for (SimpleList<String>::iterator itr = names.begin(); itr != names.end(); ++itr) {
+    String npath = path + String("/") + (*itr);
+    File entry = SD.open(String(RULES_PATH) + npath);
+    if (!entry)
+      continue;
+
     if (entry.isDirectory()) {
-      sz += loadRulesFromFile(entry, npath);
+      sz += loadRulesFromFile(entry, npath, addr + sz);
       entry.close();
       continue;
     }
@@ -302,9 +455,7 @@ int loadRulesFromFile(File &dir, String path) {
 
     ML2Rule *rule = ML2Rule::fromFile(npath);
     if (rule) {
-      int s = saveRuleEEPROM(rule, storageHeader.addrRules);
-      sz += s;
-      storageHeader.addrRules += s;
+      sz += saveRuleEEPROM(rule, addr + sz);
       storageHeader.cntRules++;
       delete rule;
       Serialprint("Loaded rule: %s\r\n", npath.c_str());
@@ -318,8 +469,9 @@ int setupRulesSD() {
 
   File root = SD.open(RULES_PATH);
   if (root) {
-    return loadRulesFromFile(root, "");
+    return loadRulesFromFile(root, "", storageHeader.addrRules);
   }
+  return 0;
 }
 
 bool loadAllFromEEPROM() {
@@ -350,15 +502,82 @@ bool loadAllFromEEPROM() {
     addr += sz;
   }
 
+  for (int i = 0; i < storageHeader.cntGroups; i++) {
+    ML2Group *group = new ML2Group("");
+    sz = loadGroupEEPROM(group, addr);
+    if (groupList.addGroup(group)) {
+      Serialprint("Added group %s with %d outputs\r\n", group->ID, group->outputs()->size());
+    } else {
+      Serialprint("Failed to add group %s\r\n", group->ID);
+      sceneList.removeScenes(group);
+      delete group;
+    }
+
+    addr += sz;
+  }
+
+  storageHeader.addrRules = addr;
+
+  return true;
+}
+
+void compileRulesEEPROM(bool add) {
+  int addr = storageHeader.addrRules;
   for (int i = 0; i < storageHeader.cntRules; i++) {
     ML2Rule *rule = new ML2Rule("");
-    sz = loadRuleEEPROM(rule, addr, true);
-    Serialprint("Added rule %s\r\n", rule->ID.c_str());
-    addr += sz;
+    addr += loadRuleEEPROM(rule, addr);
+    add ? ruleTable.add(rule) : ruleTable.count(rule);
     delete rule;
   }
+}
 
-  return true;
+// Output commands address outputs by their position in outputList
+void setupOutputs() {
+  for (byte i = 0; i < outputList.size(); i++)
+    outputList.at(i)->index = i;
+}
+
+// Inputs on pins with a pin change interrupt are captured, the others are
+// sampled a port at a time. Button events address inputs by their position
+// in inputList.
+void setupInputCapture() {
+  byte cntCaptured = 0;
+  byte cntScanned = 0;
+  for (byte i = 0; i < inputList.size(); i++) {
+    ML2Input *input = inputList.at(i);
+    input->index = i;
+    if (inputCapture.attach(input, i)) {
+      cntCaptured++;
+      continue;
+    }
+
+    int8_t port = portScanner.attach(input->pin());
+    if (port >= 0) {
+      input->setScanned(port);
+      cntScanned++;
+    }
+  }
+
+  Serialprint("Capturing %d of %d inputs by pin change interrupt, scanning %d by port\r\n", cntCaptured, inputList.size(), cntScanned);
+
+  if (!inputList.setupActive())
+    Serialprint("Not enough memory to track active inputs, checking all\r\n");
+}
+
+void setupRuleTable() {
+  ruleTable.begin();
+  compileRulesEEPROM(false);
+
+  if (!ruleTable.allocate()) {
+    ruleTable.clear();
+    Serialprint("Not enough memory for %d rules\r\n", storageHeader.cntRules);
+    return;
+  }
+
+  compileRulesEEPROM(true);
+  ruleTable.end();
+
+  Serialprint("Compiled %d rules (%d actions)\r\n", storageHeader.cntRules, ruleTable.actionCount());
 }
 
 int setupConfigSD() {
@@ -416,6 +635,11 @@ void saveAllToEEPROM() {
   addr += sz;
   Serialprint("Stored %d outputs (%d bytes)\r\n\r\n", storageHeader.cntOutputs, sz);
 
+  storageHeader.addrGroups = addr;
+  sz = setupGroupsSD();
+  addr += sz;
+  Serialprint("Stored %d groups, %d scenes (%d bytes)\r\n\r\n", storageHeader.cntGroups, sceneList.size(), sz);
+
   storageHeader.addrRules = addr;
   sz = setupRulesSD();
   addr += sz;
@@ -440,12 +664,19 @@ void setup() {
   Serial.begin(115200);
   Serialprint("Starting...\r\n");
 
+#ifdef BENCHMARK_RULES
+  benchmarkRules();
+#endif
+
   if (setupSD()) {
     saveAllToEEPROM();
   } else {
     loadAllFromEEPROM();
   }
 
+  setupOutputs();
+  setupInputCapture();
+  setupRuleTable();
   setupWeb();
   setupEMs();
   setupTasks();